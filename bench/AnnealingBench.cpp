@@ -0,0 +1,312 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "../src/AnnealingRun.h"
+#include "../src/BlockTemplate.h"
+#include "../src/Options.h"
+#include "../src/lib/Kernels.h"
+
+/*
+ * Annealing hot path microbenchmark.
+ * Measures Set, AnnealingRun and BigFloat operations on random dense lattices for every combination
+ * of value type, lattice size and link topology, and prints the results as JSON.
+ * Solver results compare sweep counts and final energies of full annealing with fixed and adaptive
+ * temperature schedules, with and without over-relaxation.
+ *
+ * OPTIONS (given as key=value command line arguments):
+ * sizes      - comma-separated lattice sizes (default 256,1024,4096; a 32768 float lattice takes 4 GiB)
+ * types      - comma-separated value types: float, double (default float,double)
+ * storage    - comma-separated lattice storage types: native, fp16, bf16, int8 (default native).
+ *              Reduced precision results are reported with the storage type after the value type
+ * topologies - comma-separated link topologies (default NONE,ALL,EXPLICIT):
+ *              NONE - independent sets, ALL - every set linked with all others,
+ *              EXPLICIT - every set linked with its two neighbours, given as explicit index lists
+ * sets       - quantity of sets in block (default 4)
+ * min_time   - minimal measurement time of a single benchmark in seconds (default 0.2)
+ * relaxation - over-relaxation factor compared with the plain iteration in solver results (default 1.5)
+ * output     - JSON output filename (default: standard output)
+ */
+
+/**
+ * Single benchmark result. Negative throughput means that it is not applicable.
+ */
+struct Result {
+    std::string benchmark, type, topology;
+    int size;
+    double ns_per_op, gb_per_s;
+};
+
+/**
+ * Full annealing result of a solver configuration, summed over several runs.
+ */
+struct SolverResult {
+    std::string type, topology, schedule;
+    int size;
+    float relaxation;
+    long sweeps, levels;
+    double hamiltonian, ms;
+};
+
+std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream parser(list);
+    std::string item;
+    while (getline(parser, item, ','))
+        if (not item.empty())
+            items.push_back(item);
+    return items;
+}
+
+/**
+ * Create link file for the given topology.
+ * @param topology Topology name
+ * @param set_count Quantity of sets in block
+ * @return Link filename, NONE if no file is needed
+ */
+std::string linkFile(const std::string &topology, int set_count) {
+    if (topology == "NONE")
+        return "NONE";
+    const char *tmp_dir = std::getenv("TMPDIR");
+    std::string filename = std::string(tmp_dir != nullptr ? tmp_dir : "/tmp") + "/MARS_CI_bench_" + topology;
+    std::ofstream ofs(filename);
+    ofs << set_count << std::endl;
+    for (int set_index = 0; set_index < set_count; ++set_index) {
+        if (topology == "ALL") {
+            ofs << "ALL" << std::endl;
+        } else if (topology == "EXPLICIT") {
+            int previous = (set_index + set_count - 1) % set_count, next = (set_index + 1) % set_count;
+            ofs << previous << " " << next << std::endl;
+        } else {
+            throw std::invalid_argument("Unknown topology " + topology);
+        }
+    }
+    return filename;
+}
+
+/**
+ * Measure average time of a single call of the given operation.
+ * @param operation Function that performs one operation and returns a checksum
+ * @param min_time Minimal measurement time in seconds
+ * @return Nanoseconds per operation
+ */
+template<typename F>
+double measure(F operation, double min_time) {
+    volatile double checksum = 0;
+    long count = 0, batch = 1;
+    double elapsed = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (elapsed < min_time) {
+        for (long i = 0; i < batch; ++i)
+            checksum = checksum + operation();
+        count += batch;
+        batch *= 2;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return elapsed * 1e9 / (double) count;
+}
+
+// Quantity of runs annealed by every solver configuration
+constexpr int SOLVER_RUNS = 4;
+
+/**
+ * Run all Set and AnnealingRun benchmarks for a single lattice and topology.
+ */
+template<typename T>
+void benchLattice(Lattice<T> &lattice, const std::string &type, const std::string &topology, int set_count,
+                  const Options &options, std::vector<Result> &results, std::vector<SolverResult> &solver_results) {
+    double min_time = options.getDouble("min_time", 0.2);
+    int size = lattice.size();
+    std::string link_filename = linkFile(topology, set_count);
+    BlockTemplate<T> block_template(size, set_count, link_filename);
+    // Same state AnnealingRun::prepare leaves a block in
+    Block<T> block = block_template.instance(0);
+    for (int set_index = 0; set_index < set_count; ++set_index) {
+        block[set_index].bindLattice(lattice);
+        for (int link_index = 0; link_index < block[set_index].linkedSets(); ++link_index)
+            block[set_index].recalculateProbabilities(link_index);
+    }
+    BigFloat multiplier{1, -2};
+    double element_size = (double) LatticeFile::elementSize(lattice.storageType());
+    auto add = [&](const std::string &benchmark, double ns_per_op, double bytes_per_op) {
+        results.push_back(Result{benchmark, type, topology, size, ns_per_op,
+                                 bytes_per_op > 0 ? bytes_per_op / ns_per_op : -1});
+    };
+
+    int spin_index = 0;
+    add("Set::meanField", measure([&] {
+        spin_index = (spin_index + 1) % size;
+        return (double) block[0].meanField(spin_index, lattice, multiplier);
+    }, min_time), 0);
+
+    // Zero local field leaves the interaction term only
+    add("Set::interactionMeanField", measure([&] {
+        spin_index = (spin_index + 1) % size;
+        return (double) block[0].meanField(spin_index, 0., multiplier);
+    }, min_time), 0);
+
+    // Alternate between two value arrays so that every call changes the spin
+    std::vector<T> values[2] = {std::vector<T>(size), std::vector<T>(size)};
+    Random::Stream stream(1, 0);
+    stream.fill(values[0].data(), size, -1, 1);
+    stream.fill(values[1].data(), size, -1, 1);
+    long call_index = 0;
+    add("Set::setSpin", measure([&] {
+        int index = (int) (call_index % size);
+        block.setSpin(0, index, values[(call_index++ / size) % 2][index]);
+        return 0.;
+    }, min_time), (double) size * (element_size + 2 * sizeof(double)));
+
+    if (block[0].linkedSets() > 0)
+        add("Set::recalculateProbabilities", measure([&] {
+            block[0].recalculateProbabilities(0);
+            return 0.;
+        }, min_time) / size, 2. * sizeof(T));
+
+    // Every spin update of a sweep is counted as one lattice row pass
+    double elapsed = 0;
+    long spin_updates = 0;
+    for (int run_index = 0; elapsed < min_time; ++run_index) {
+        AnnealingRun<T> run(lattice);
+        run.block = block_template.instance(run_index);
+        run.prepare();
+        run.temperature = 0.5f * std::sqrt((float) size);
+        run.temperature_threshold = 0;
+        run.interaction_multiplier = multiplier;
+        auto start = std::chrono::steady_clock::now();
+        run.annealingStep();
+        elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        spin_updates += (long) run.step_counter * set_count * size;
+    }
+    add("AnnealingRun::annealingStep", elapsed * 1e9 / (double) spin_updates, (double) size * element_size);
+
+    // Full annealing from the same blocks with every schedule and relaxation factor
+    for (bool adaptive : {false, true}) {
+        for (float relaxation : {1.f, (float) options.getDouble("relaxation", 1.5)}) {
+            SolverResult result{type, topology, adaptive ? "adaptive" : "fixed", size, relaxation, 0, 0, 0, 0};
+            for (int run_index = 0; run_index < SOLVER_RUNS; ++run_index) {
+                AnnealingRun<T> run(lattice);
+                run.block = block_template.instance(run_index);
+                run.temperature = 0.5f * std::sqrt((float) size);
+                run.temperature_step = run.temperature / 32;
+                if (adaptive) {
+                    run.temperature_step_min = run.temperature_step / 8;
+                    run.temperature_step_max = run.temperature_step * 8;
+                }
+                run.temperature_threshold = 0;
+                run.interaction_multiplier = multiplier;
+                run.relaxation = relaxation;
+                run.level_finished = [&result](AnnealingRun<T> &) { result.levels++; };
+                auto start = std::chrono::steady_clock::now();
+                run.anneal();
+                result.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                result.sweeps += run.step_counter;
+                for (int set_index = 0; set_index < set_count; ++set_index)
+                    result.hamiltonian += run[set_index].hamiltonian(lattice) / (SOLVER_RUNS * set_count);
+            }
+            solver_results.push_back(result);
+        }
+    }
+
+    if (link_filename != "NONE")
+        std::remove(link_filename.c_str());
+}
+
+/**
+ * Run benchmarks for all sizes and topologies of a value type.
+ */
+template<typename T>
+void benchType(const std::string &type, const Options &options, std::vector<Result> &results,
+               std::vector<SolverResult> &solver_results) {
+    for (const std::string &size : split(options.get("sizes", "256,1024,4096"))) {
+        Lattice<T> full_lattice(std::stoi(size), true);
+        for (const std::string &storage : split(options.get("storage", "native"))) {
+            Lattice<T> lattice = storage == "native" ? full_lattice : full_lattice.pack(LatticeFile::parseType(storage));
+            std::string label = storage == "native" ? type : type + "/" + storage;
+            for (const std::string &topology : split(options.get("topologies", "NONE,ALL,EXPLICIT"))) {
+                std::cerr << label << " " << size << " " << topology << std::endl;
+                benchLattice(lattice, label, topology, options.getInt("sets", 4), options, results, solver_results);
+            }
+        }
+    }
+}
+
+/**
+ * Run BigFloat arithmetic benchmarks on the operand mix of Set::interactionMeanField.
+ */
+void benchBigFloat(double min_time, std::vector<Result> &results) {
+    const int operand_count = 1024;
+    std::vector<double> operands(operand_count);
+    Random::Stream stream(2, 0);
+    for (double &operand : operands)
+        operand = stream.uniform(0.01, 2);
+    int index = 0;
+    BigFloat accumulator{1};
+    auto next = [&] { return BigFloat(operands[index = (index + 1) % operand_count]); };
+    auto add = [&](const std::string &benchmark, double ns_per_op) {
+        results.push_back(Result{benchmark, "BigFloat", "", 0, ns_per_op, -1});
+    };
+    add("BigFloat::operator*", measure([&] { return (double) (accumulator = next() * next()); }, min_time));
+    add("BigFloat::operator/", measure([&] { return (double) (accumulator = next() / next()); }, min_time));
+    add("BigFloat::operator+", measure([&] { return (double) (accumulator = next() + next()); }, min_time));
+    add("BigFloat::log", measure([&] { return next().log(); }, min_time));
+}
+
+void writeJson(std::ostream &out, const std::vector<Result> &results, const std::vector<SolverResult> &solver_results) {
+    out << "{" << std::endl;
+    out << "  \"kernels\": {\"float\": \"" << Kernels::kernels<float>().name << "\", \"double\": \""
+        << Kernels::kernels<double>().name << "\"}," << std::endl;
+    out << "  \"results\": [" << std::endl;
+    for (unsigned int result_index = 0; result_index < results.size(); ++result_index) {
+        const Result &result = results[result_index];
+        out << "    {\"benchmark\": \"" << result.benchmark << "\", \"type\": \"" << result.type << "\"";
+        if (result.size > 0)
+            out << ", \"size\": " << result.size << ", \"topology\": \"" << result.topology << "\"";
+        out << ", \"ns_per_op\": " << result.ns_per_op;
+        if (result.gb_per_s >= 0)
+            out << ", \"gb_per_s\": " << result.gb_per_s;
+        out << "}" << (result_index + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]," << std::endl;
+    out << "  \"solvers\": [" << std::endl;
+    for (unsigned int result_index = 0; result_index < solver_results.size(); ++result_index) {
+        const SolverResult &result = solver_results[result_index];
+        out << "    {\"type\": \"" << result.type << "\", \"size\": " << result.size << ", \"topology\": \""
+            << result.topology << "\", \"schedule\": \"" << result.schedule << "\", \"relaxation\": "
+            << result.relaxation << ", \"sweeps\": " << result.sweeps << ", \"levels\": " << result.levels
+            << ", \"hamiltonian\": " << result.hamiltonian << ", \"ms\": " << result.ms << "}"
+            << (result_index + 1 < solver_results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl << "}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    Options options(argc, argv);
+    std::vector<Result> results;
+    std::vector<SolverResult> solver_results;
+    benchBigFloat(options.getDouble("min_time", 0.2), results);
+    for (const std::string &type : split(options.get("types", "float,double"))) {
+        if (type == "float") {
+            benchType<float>(type, options, results, solver_results);
+        } else if (type == "double") {
+            benchType<double>(type, options, results, solver_results);
+        } else {
+            std::cerr << "Unknown value type " << type << std::endl;
+            return 2;
+        }
+    }
+
+    if (options.has("output")) {
+        std::ofstream ofs(options.get("output"));
+        writeJson(ofs, results, solver_results);
+    } else {
+        writeJson(std::cout, results, solver_results);
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "../src/lib/BigFloat.h"
+#include "../src/lib/Random.h"
+
+/*
+ * BigFloat microbenchmark and accuracy check.
+ * Compares the binary BigFloat against the former decimal implementation on the operation mix
+ * used in Set::setSpin and Set::recalculateProbabilities, and checks results against long double.
+ */
+
+namespace Legacy {
+    /**
+     * Decimal-exponent BigFloat implementation that preceded the binary one, kept for comparison.
+     */
+    class BigFloat {
+    private:
+        double mantissa;
+        long exponent;
+
+        void setupPrecision();
+
+        BigFloat add(BigFloat _bigFloat);
+
+        BigFloat multiplyBy(BigFloat _bigFloat);
+
+        BigFloat oneDivideByThis();
+
+        bool equals(BigFloat _bigFloat);
+
+        bool moreThan(BigFloat _bigFloat);
+
+        BigFloat getCopy();
+
+    public:
+        BigFloat(double _base, double _exp = 0) {
+            if (_base == 0) {
+                mantissa = _base;
+                exponent = 0;
+                return;
+            }
+            mantissa = _base * exp10(_exp - (double) (long) _exp);
+            exponent = (long) _exp;
+            setupPrecision();
+        }
+
+        double log() { return (double) exponent + std::log(mantissa); }
+
+        explicit operator float() {
+            this->setupPrecision();
+            if (exponent >= 38)  // Prevent overflow
+                return FLT_MAX * (float) (mantissa > 0 ? 1 : -1);
+            return (float) mantissa * exp10f((float) exponent);
+        }
+
+        explicit operator double() {
+            this->setupPrecision();
+            if (exponent >= 308)  // Prevent overflow
+                return DBL_MAX * (double) (mantissa > 0 ? 1 : -1);
+            return mantissa * exp10((double) exponent);
+        }
+
+        explicit operator std::string() {
+            std::ostringstream oss;
+            oss << mantissa << "e" << exponent;
+            return oss.str();
+        }
+
+        BigFloat &operator=(float _float) {
+            *this = BigFloat(_float);
+            return *this;
+        }
+
+        bool operator==(BigFloat _bigFloat) { return this->equals(_bigFloat); }
+
+        bool operator!=(BigFloat _bigFloat) { return not(*this == _bigFloat); }
+
+        BigFloat operator+(BigFloat _bigFloat) { return this->getCopy().add(_bigFloat); }
+
+        BigFloat operator*(BigFloat _bigFloat) { return this->getCopy().multiplyBy(_bigFloat); }
+
+        BigFloat operator/(BigFloat _bigFloat) {
+            return this->getCopy().multiplyBy(_bigFloat.getCopy().oneDivideByThis());
+        }
+
+        void operator+=(BigFloat _bigFloat) { this->add(_bigFloat); }
+
+        void operator-=(BigFloat _bigFloat) { this->add(_bigFloat * -1); }
+
+        void operator*=(BigFloat _bigFloat) { this->multiplyBy(_bigFloat); }
+
+        bool operator>(BigFloat _bigFloat) { return this->moreThan(_bigFloat); }
+
+        bool operator<(BigFloat _bigFloat) { return not(*this == _bigFloat) and not(*this > _bigFloat); }
+    };
+
+    inline void BigFloat::setupPrecision() {
+        if (mantissa == 0 or std::isinf(mantissa)) {
+            exponent = 0;
+            return;
+        }
+        while (std::fabs(mantissa) > 10) {
+            mantissa /= 10;
+            exponent += 1;
+        }
+        while (std::fabs(mantissa) < 1) {
+            mantissa *= 10;
+            exponent -= 1;
+        }
+    }
+
+    inline BigFloat BigFloat::add(BigFloat _bigFloat) {
+        if (_bigFloat.mantissa == 0)
+            return *this;
+        if (mantissa == 0) {
+            mantissa = _bigFloat.mantissa;
+            exponent = _bigFloat.exponent;
+            return *this;
+        }
+
+        if (exponent < _bigFloat.exponent) {
+            long expDiff = _bigFloat.exponent - exponent;
+            mantissa /= exp10f((float) expDiff);
+            exponent += expDiff;
+        }
+        mantissa += _bigFloat.mantissa * exp10f((float) (_bigFloat.exponent - exponent));
+        setupPrecision();
+        return *this;
+    }
+
+    inline BigFloat BigFloat::multiplyBy(BigFloat _bigFloat) {
+        mantissa *= _bigFloat.mantissa;
+        exponent += _bigFloat.exponent;
+        setupPrecision();
+        return *this;
+    }
+
+    inline BigFloat BigFloat::oneDivideByThis() {
+        mantissa = 1. / mantissa;
+        exponent *= -1;
+        setupPrecision();
+        return *this;
+    }
+
+    inline bool BigFloat::equals(BigFloat _bigFloat) {
+        return _bigFloat.mantissa == mantissa and _bigFloat.exponent == exponent;
+    }
+
+    inline bool BigFloat::moreThan(BigFloat _bigFloat) {
+        return mantissa * _bigFloat.mantissa <= 0 ? mantissa > _bigFloat.mantissa :
+               exponent > _bigFloat.exponent ? true :
+               _bigFloat.exponent > exponent ? false : mantissa > _bigFloat.mantissa;
+    }
+
+    inline BigFloat BigFloat::getCopy() {
+        BigFloat bf{0};
+        bf.mantissa = mantissa;
+        bf.exponent = exponent;
+        return bf;
+    }
+}
+
+constexpr int factor_count = 1 << 16;
+constexpr int repeat_count = 64;
+
+/**
+ * Measure average time of a single call of the given operation.
+ * @param operation Function that performs factor_count operations and returns a checksum
+ * @return Nanoseconds per operation
+ */
+template<typename F>
+double measure(F operation) {
+    volatile double checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int repeat = 0; repeat < repeat_count; ++repeat)
+        checksum = checksum + operation();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(finish - start).count() / repeat_count / factor_count;
+}
+
+/**
+ * Run the probability update operation mix: p *= (1 + a * b) / (1 + a * c).
+ * @tparam B BigFloat implementation
+ */
+template<typename B>
+double probabilityUpdate(const std::vector<float> &a, const std::vector<float> &b, const std::vector<float> &c) {
+    B probability{1};
+    for (int i = 0; i < factor_count; ++i)
+        probability *= B(1 + a[i] * b[i]) / B(1 + a[i] * c[i]);
+    return (double) probability;
+}
+
+/**
+ * Run the mean field accumulation operation mix: s += m * 0.5 * log(p * x / y).
+ * @tparam B BigFloat implementation
+ */
+template<typename B>
+double fieldAccumulation(const std::vector<float> &a, const std::vector<float> &b, const std::vector<float> &c) {
+    B sum{0}, multiplier{1, -2};
+    for (int i = 0; i < factor_count; ++i)
+        sum += multiplier * 0.5 * (B(1 + a[i]) * B(1 + b[i]) / B(1 + c[i])).log();
+    return (double) sum;
+}
+
+int main() {
+    Random::Stream stream(0, 0, 0);
+    std::vector<float> a(factor_count), b(factor_count), c(factor_count);
+    stream.fill(a.data(), factor_count, -1, 1);
+    stream.fill(b.data(), factor_count, -1, 1);
+    stream.fill(c.data(), factor_count, -1, 1);
+
+    std::cout << std::setw(24) << std::left << "Operation" << std::setw(16) << "Legacy, ns" << "Binary, ns"
+              << std::endl;
+    std::cout << std::setw(24) << "probability update" << std::setw(16)
+              << measure([&] { return probabilityUpdate<Legacy::BigFloat>(a, b, c); })
+              << measure([&] { return probabilityUpdate<BigFloat>(a, b, c); }) << std::endl;
+    std::cout << std::setw(24) << "field accumulation" << std::setw(16)
+              << measure([&] { return fieldAccumulation<Legacy::BigFloat>(a, b, c); })
+              << measure([&] { return fieldAccumulation<BigFloat>(a, b, c); }) << std::endl;
+
+    // Accuracy against long double, products reach far beyond the double range
+    long double reference_log = 0;
+    BigFloat product{1};
+    double max_sum_error = 0, max_quotient_error = 0;
+    for (int i = 0; i < factor_count; ++i) {
+        long double factor = (1 + a[i] * b[i]) / 2.L;
+        reference_log += std::log(factor);
+        product *= BigFloat((double) factor);
+
+        long double x = a[i] * 1e3L, y = c[i] * 1e-3L;
+        long double exact_sum = x + y, exact_quotient = x / y;
+        double sum = (double) (BigFloat((double) x) + BigFloat((double) y));
+        double quotient = (double) (BigFloat((double) x) / BigFloat((double) y));
+        if (exact_sum != 0)
+            max_sum_error = std::max(max_sum_error, (double) std::fabs((sum - exact_sum) / exact_sum));
+        max_quotient_error = std::max(max_quotient_error,
+                                      (double) std::fabs((quotient - exact_quotient) / exact_quotient));
+    }
+    double product_error = std::fabs((product.log() - (double) reference_log) / (double) reference_log);
+    double round_trip_error = std::fabs(BigFloat::fromLog((double) reference_log).log() - (double) reference_log);
+
+    std::cout << std::endl << "Relative error against long double:" << std::endl;
+    std::cout << std::setw(24) << "product log" << product_error << std::endl;
+    std::cout << std::setw(24) << "sum" << max_sum_error << std::endl;
+    std::cout << std::setw(24) << "quotient" << max_quotient_error << std::endl;
+    std::cout << std::setw(24) << "log round trip" << round_trip_error << std::endl;
+
+    bool accurate = product_error < 1e-12 and max_sum_error < 1e-15 and max_quotient_error < 1e-15 and
+                    round_trip_error < 1e-6;
+    std::cout << (accurate ? "Accuracy check passed" : "Accuracy check FAILED") << std::endl;
+    return accurate ? 0 : 1;
+}
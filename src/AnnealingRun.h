@@ -5,8 +5,13 @@
 #ifndef MARS_CI_ANNEALINGRUN_H
 #define MARS_CI_ANNEALINGRUN_H
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
 #include "lib/Lattice.h"
 #include "lib/Block.h"
+#include "lib/Metrics.h"
 #include "lib/Set.h"
 
 /**
@@ -18,10 +23,45 @@ template<typename T>
 struct AnnealingRun {
     float temperature = 10, temperature_step = 1, temperature_threshold = 1;
     BigFloat interaction_multiplier = 0;
+
+    /**
+     * Adaptive schedule bounds. If temperature_step_max is greater than temperature_step_min, the step grows
+     * after temperature levels that converged in fewer sweeps than usual and shrinks after levels that took
+     * much longer, which happens near transitions. The step starts from temperature_step.
+     * Otherwise the temperature is lowered by temperature_step.
+     */
+    float temperature_step_min = 0, temperature_step_max = 0;
+
+    /**
+     * Adaptive schedule state: current step and moving average of level sweep counts. The average is 0 before
+     * the first level has finished and negative until the second one has.
+     */
+    float schedule_step = 0, level_sweeps_average = 0;
+
+    /**
+     * Over-relaxation factor: a spin moves by relaxation times the distance to its mean-field value.
+     * 1 is the plain fixed-point iteration, values between 1 and 2 take bigger steps along slow modes.
+     */
+    float relaxation = 1;
+
+    /**
+     * Interaction formula. Sweeps are compiled for every formula, the formula is chosen once per temperature level.
+     */
+    FormulaType formula = FORMULA_SYM;
     const Lattice<T> &lattice;
     Block<T> block;
     int step_counter = 0;
 
+    /**
+     * Function called every time the run converges at a temperature level, if set.
+     */
+    std::function<void(AnnealingRun<T> &)> level_finished{};
+
+    /**
+     * Flag that stops annealing after the current temperature level, may be set by level_finished.
+     */
+    bool stopped = false;
+
     /**
      * Minimal AnnealingRun constructor.
      * @param lattice Lattice object
@@ -33,12 +73,55 @@ struct AnnealingRun {
      * @param index Set index in block
      * @return Set object
      */
-    Set<T> operator[](int index);
+    Set<T> &operator[](int index);
+
+    /**
+     * Get interaction multiplier that applies at current temperature.
+     * @return Interaction multiplier, zero below the temperature threshold
+     */
+    BigFloat currentMultiplier();
+
+    /**
+     * Calculate spin value that satisfies the mean-field equation at current temperature.
+     * @param mean_field Mean field value
+     * @return Spin value
+     */
+    T spinValue(const BigFloat &mean_field);
+
+    /**
+     * Get the value a spin moves to during a sweep.
+     * @param old_value Current spin value
+     * @param target_value Spin value that satisfies the mean-field equation
+     * @return New spin value
+     */
+    T relaxedValue(T old_value, T target_value);
+
+    /**
+     * Lower the temperature to the next level of the schedule.
+     * @param level_sweeps Quantity of sweeps the previous level took, 0 if no level has finished since the run
+     * was started or restored
+     */
+    void lowerTemperature(int level_sweeps);
 
     /**
      * Perform a single annealing step so that the spin values correspond the mean-field equation.
+     * @return Quantity of sweeps taken
      */
-    void annealingStep();
+    int annealingStep();
+
+    /**
+     * Perform a single annealing step with the given interaction formula.
+     * @tparam F Interaction formula policy (see Formula.h)
+     * @return Quantity of sweeps taken
+     */
+    template<typename F>
+    int annealingSweeps();
+
+    /**
+     * Bind the local field caches of all sets to the lattice and recalculate link probabilities.
+     * Must be called before annealingStep if the run is not annealed with anneal.
+     */
+    void prepare();
 
     /**
      * Perform a full annealing operation.
@@ -48,35 +131,85 @@ struct AnnealingRun {
 
 constexpr float threshold = 0.001;
 
+// Adaptive schedule halves the step after levels that took SLOW_LEVEL_RATIO times more sweeps than
+// the moving average and doubles it after levels that took fewer sweeps than the average
+constexpr float SLOW_LEVEL_RATIO = 2, LEVEL_AVERAGE_WEIGHT = 0.25;
+
 template<typename T>
-Set<T> AnnealingRun<T>::operator[](int index) {
+Set<T> &AnnealingRun<T>::operator[](int index) {
     return block[index];
 }
 
 template<typename T>
-void AnnealingRun<T>::annealingStep() {
+BigFloat AnnealingRun<T>::currentMultiplier() {
+    if (temperature > temperature_threshold and temperature > 0)
+        return interaction_multiplier;
+    return BigFloat(0);
+}
+
+template<typename T>
+T AnnealingRun<T>::spinValue(const BigFloat &mean_field) {
+    if (temperature > 0)
+        return tanh((T) (mean_field / -temperature));
+    return mean_field > 0 ? -1 : 1;
+}
+
+template<typename T>
+T AnnealingRun<T>::relaxedValue(T old_value, T target_value) {
+    if (relaxation == 1)
+        return target_value;
+    T value = old_value + relaxation * (target_value - old_value);
+    return value > 1 ? 1 : value < -1 ? -1 : value;
+}
+
+template<typename T>
+void AnnealingRun<T>::lowerTemperature(int level_sweeps) {
+    if (temperature_step_max <= temperature_step_min) {
+        temperature -= temperature_step;
+        return;
+    }
+    if (schedule_step <= 0) {
+        schedule_step = std::min(std::max(temperature_step, temperature_step_min), temperature_step_max);
+    } else if (level_sweeps <= 0) {
+        // Nothing to adapt to, the run has been restored from a checkpoint
+    } else if (level_sweeps_average == 0) {
+        // The first level starts from random spins and takes far more sweeps than the following ones,
+        // so it is skipped and the second level sets the reference
+        level_sweeps_average = -1;
+    } else if (level_sweeps_average < 0) {
+        level_sweeps_average = (float) level_sweeps;
+    } else {
+        if ((float) level_sweeps >= SLOW_LEVEL_RATIO * level_sweeps_average)
+            schedule_step = std::max(schedule_step / 2, temperature_step_min);
+        else if ((float) level_sweeps < level_sweeps_average)
+            schedule_step = std::min(2 * schedule_step, temperature_step_max);
+        level_sweeps_average += LEVEL_AVERAGE_WEIGHT * ((float) level_sweeps - level_sweeps_average);
+    }
+    temperature -= schedule_step;
+}
+
+template<typename T>
+int AnnealingRun<T>::annealingStep() {
+    auto level_start = std::chrono::steady_clock::now();
+    int sweeps = formula == FORMULA_ASYM ? annealingSweeps<AsymmetricFormula>() : annealingSweeps<SymmetricFormula>();
+    Metrics::annealingTime(Metrics::since(level_start));
+    Metrics::levelFinished(temperature, sweeps, (long) sweeps * block.set_count * block.setSize());
+    return sweeps;
+}
+
+template<typename T>
+template<typename F>
+int AnnealingRun<T>::annealingSweeps() {
+    BigFloat multiplier = currentMultiplier();
     bool proceed_iteration = true;
+    int sweeps = 0;
     while (proceed_iteration) {
         proceed_iteration = false;
         for (int set_index = 0; set_index < block.set_count; ++set_index) {
-            // Update stored probability values
-            for (int link_index = 0; link_index < block[set_index].linkedSets(); ++link_index)
-                block[set_index].recalculateProbabilities(link_index);
-
             for (int spin_index = 0; spin_index < block.setSize(); ++spin_index) {
-                // Calculate mean field
-                BigFloat mean_field{0};
-                if (temperature > temperature_threshold and temperature > 0)
-                    mean_field = block[set_index].meanField(spin_index, lattice, interaction_multiplier);
-                else
-                    mean_field = block[set_index].meanField(spin_index, lattice, BigFloat(0));
-
-                // Calculate new spin value
-                T new_spin_value;
-                if (temperature > 0)
-                    new_spin_value = tanh((T) (mean_field / -temperature));
-                else
-                    new_spin_value = mean_field > 0 ? -1 : 1;
+                // Calculate mean field and new spin value
+                BigFloat mean_field = block[set_index].template meanField<F>(spin_index, lattice, multiplier);
+                T new_spin_value = spinValue(mean_field);
 
                 // Check threshold
                 T old_spin_value = block[set_index][spin_index];
@@ -84,18 +217,34 @@ void AnnealingRun<T>::annealingStep() {
                     proceed_iteration = true;
 
                 // Write spin value
-                block.setSpin(set_index, spin_index, new_spin_value);
+                block.setSpin(set_index, spin_index, relaxedValue(old_spin_value, new_spin_value));
             }
         }
         step_counter++;
+        sweeps++;
+    }
+    return sweeps;
+}
+
+template<typename T>
+void AnnealingRun<T>::prepare() {
+    // Sweeps read mean field values from the local field cache, probabilities are kept up to date by setSpin
+    for (int set_index = 0; set_index < block.set_count; ++set_index) {
+        block[set_index].bindLattice(lattice);
+        for (int link_index = 0; link_index < block[set_index].linkedSets(); ++link_index)
+            block[set_index].recalculateProbabilities(link_index);
     }
 }
 
 template<typename T>
 void AnnealingRun<T>::anneal() {
-    while (temperature > 0) {
-        temperature -= temperature_step;
-        annealingStep();
+    prepare();
+    int level_sweeps = 0;
+    while (temperature > 0 and not stopped) {
+        lowerTemperature(level_sweeps);
+        level_sweeps = annealingStep();
+        if (level_finished)
+            level_finished(*this);
     }
 }
 
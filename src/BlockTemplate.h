@@ -29,7 +29,7 @@ private:
     int set_size = 0;
     int set_count = 0;
     std::vector<SetReference> sets = std::vector<SetReference>();
-    SetLink *links = nullptr;
+    std::vector<SetLink> links{};
 
     /**
      * Load link information from specified file.
@@ -61,19 +61,20 @@ public:
 
     /**
      * Create a Block object that matches the template represented by this.
+     * The block owns its spin values, every set is copied from its template.
+     * Random set values are taken from streams keyed by the run index, so every run gets the same block
+     * regardless of the order in which runs are instantiated.
+     * @param run_index Index of the run the block is created for
      * @return Block object
      */
-    Block<T> instance();
+    Block<T> instance(int run_index);
 };
 
 template<typename T>
 void BlockTemplate<T>::loadLinks(const std::string &link_filename) {
-    links = new SetLink[set_count];
-    if (link_filename == "NONE") {
-        for (int link_index = 0; link_index < set_count; ++link_index)
-            links[link_index] = SetLink();
+    links.assign(set_count, SetLink());
+    if (link_filename == "NONE")
         return;
-    }
     auto ifs = std::ifstream(link_filename);
     int block_size = 0;
     ifs >> block_size;
@@ -98,11 +99,10 @@ void BlockTemplate<T>::loadLinks(const std::string &link_filename) {
             // Set values will be unchanged during block annealing
             link.push_back(-1);
         } else {
-            // Read line to find out
+            // Read line to find out, it may list fewer sets than the block has
             std::stringstream line_parser(line);
-            for (int j = 0; j < block_size; ++j) {
-                int buf = 0;
-                line_parser >> buf;
+            int buf;
+            for (int j = 0; j < block_size and line_parser >> buf; ++j) {
                 if (link.empty() or std::find(link.begin(), link.end(), buf) == link.end())
                     // Duplicates are ignored
                     link.push_back(buf);
@@ -152,11 +152,14 @@ BlockTemplate<T>::BlockTemplate(int set_size, int set_count, const std::string &
 }
 
 template<typename T>
-Block<T> BlockTemplate<T>::instance() {
-    auto *sets_out = new Set<T>[set_count];
-    for (int set_index = 0; set_index < set_count; ++set_index)
-        sets_out[set_index] = sets[set_index]->instance();
-    return Block<T>(set_count, sets_out, links);
+Block<T> BlockTemplate<T>::instance(int run_index) {
+    Block<T> block(set_count, set_size, links);
+    for (int set_index = 0; set_index < set_count; ++set_index) {
+        Random::Stream stream(run_index, set_index);
+        sets[set_index]->fill(block.setValues(set_index), stream);
+    }
+    block.syncColumns();
+    return block;
 }
 
 #endif //MARS_CI_BLOCKTEMPLATE_H
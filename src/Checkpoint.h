@@ -0,0 +1,163 @@
+#ifndef MARS_CI_CHECKPOINT_H
+#define MARS_CI_CHECKPOINT_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "lib/LatticeFile.h"
+#include "lib/Random.h"
+#include "AnnealingRun.h"
+
+/**
+ * This namespace describes checkpoints of annealing runs.
+ * A checkpoint holds the state of a run after a completed temperature level: a Header followed by
+ * set_count set entries (int32 set type and set_size spin values of the run value type) and an FNV-1a
+ * checksum of everything before it. Checkpoints are replaced as a whole, so a file holds either the previous
+ * or the next state of the run.
+ */
+namespace Checkpoint {
+    constexpr char MAGIC[8] = {'M', 'A', 'R', 'S', 'C', 'K', 'P', '\0'};
+    constexpr uint32_t VERSION = 2;
+
+    /**
+     * Run states.
+     */
+    enum Status : uint32_t {
+        RUNNING = 1,
+        FINISHED = 2
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t status;
+        uint64_t run_key;       // Session::runKey of the session the run belongs to
+        uint64_t seed;          // Random generator seed, random set values come from streams keyed by run index
+        int32_t run_index;
+        int32_t step_counter;
+        float start_temp;
+        float temperature;
+        float schedule_step;            // Adaptive schedule state, see AnnealingRun
+        float level_sweeps_average;
+        int32_t set_count;
+        int32_t set_size;
+        uint32_t data_type;
+        uint32_t reserved;
+    };
+
+    /**
+     * Get checkpoint filename of a run.
+     * @param directory Checkpoint directory
+     * @param run_key Session run key
+     * @param run_index Run index
+     * @return Checkpoint filename
+     */
+    inline std::string filename(const std::string &directory, uint64_t run_key, int run_index) {
+        std::ostringstream oss;
+        oss << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << run_key << std::dec << "_"
+            << run_index << ".ckpt";
+        return oss.str();
+    }
+
+    /**
+     * Encode run state. The run should be at the end of a temperature level.
+     * @param run AnnealingRun object
+     * @param run_key Session run key
+     * @param run_index Run index
+     * @param start_temp Start temperature of the run
+     * @param status Run status
+     * @return Checkpoint data
+     */
+    template<typename T>
+    std::string encode(AnnealingRun<T> &run, uint64_t run_key, int run_index, float start_temp, Status status) {
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.status = status;
+        header.run_key = run_key;
+        header.seed = Random::globalSeed();
+        header.run_index = run_index;
+        header.step_counter = run.step_counter;
+        header.start_temp = start_temp;
+        header.temperature = run.temperature;
+        header.schedule_step = run.schedule_step;
+        header.level_sweeps_average = run.level_sweeps_average;
+        header.set_count = run.block.set_count;
+        header.set_size = run.block.setSize();
+        header.data_type = LatticeFile::dataType<T>();
+
+        std::string data((const char *) &header, sizeof(header));
+        for (int set_index = 0; set_index < run.block.set_count; ++set_index) {
+            auto set_type = (int32_t) run[set_index].set_type;
+            data.append((const char *) &set_type, sizeof(set_type));
+            for (int spin_index = 0; spin_index < header.set_size; ++spin_index) {
+                T value = run[set_index][spin_index];
+                data.append((const char *) &value, sizeof(value));
+            }
+        }
+        uint64_t checksum = LatticeFile::checksum(LatticeFile::CHECKSUM_SEED, data.data(), data.size());
+        data.append((const char *) &checksum, sizeof(checksum));
+        return data;
+    }
+
+    /**
+     * Restore run state from its checkpoint.
+     * Checkpoints that are missing, damaged or belong to another session or run are ignored.
+     * @param filename Checkpoint filename
+     * @param run AnnealingRun object created for the run
+     * @param run_key Session run key
+     * @param run_index Run index
+     * @param status Status of the restored run
+     * @return True if the state was restored
+     */
+    template<typename T>
+    bool restore(const std::string &filename, AnnealingRun<T> &run, uint64_t run_key, int run_index, Status &status) {
+        std::ifstream ifs(filename, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        Header header{};
+        if (data.size() < sizeof(header) + sizeof(uint64_t))
+            return false;
+        std::memcpy(&header, data.data(), sizeof(header));
+        uint64_t checksum = 0;
+        std::memcpy(&checksum, data.data() + data.size() - sizeof(checksum), sizeof(checksum));
+        uint64_t body_length = (uint64_t) run.block.set_count * (sizeof(int32_t) + run.block.setSize() * sizeof(T));
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 or header.version != VERSION or
+            header.run_key != run_key or header.seed != Random::globalSeed() or header.run_index != run_index or
+            header.set_count != run.block.set_count or header.set_size != run.block.setSize() or
+            header.data_type != LatticeFile::dataType<T>() or
+            data.size() != sizeof(header) + body_length + sizeof(checksum) or
+            checksum != LatticeFile::checksum(LatticeFile::CHECKSUM_SEED, data.data(), data.size() - sizeof(checksum)))
+            return false;
+
+        const char *entry = data.data() + sizeof(header);
+        for (int set_index = 0; set_index < header.set_count; ++set_index) {
+            int32_t set_type = 0;
+            std::memcpy(&set_type, entry, sizeof(set_type));
+            if (set_type != (int32_t) run[set_index].set_type)
+                return false;
+            entry += sizeof(set_type) + header.set_size * sizeof(T);
+        }
+        entry = data.data() + sizeof(header);
+        for (int set_index = 0; set_index < header.set_count; ++set_index) {
+            entry += sizeof(int32_t);
+            for (int spin_index = 0; spin_index < header.set_size; ++spin_index) {
+                T value;
+                std::memcpy(&value, entry, sizeof(value));
+                run.block.setSpin(set_index, spin_index, value);
+                entry += sizeof(value);
+            }
+        }
+        run.temperature = header.temperature;
+        run.schedule_step = header.schedule_step;
+        run.level_sweeps_average = header.level_sweeps_average;
+        run.step_counter = header.step_counter;
+        status = (Status) header.status;
+        return true;
+    }
+}
+
+#endif //MARS_CI_CHECKPOINT_H
@@ -0,0 +1,117 @@
+#ifndef MARS_CI_OPTIONS_H
+#define MARS_CI_OPTIONS_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Represents optional program parameters given as key=value command line arguments.
+ * Leading dashes of keys are ignored, so --replicas=8 and replicas=8 are equivalent.
+ */
+class Options {
+private:
+    std::map<std::string, std::string> values{};
+
+public:
+    /**
+     * Default Options constructor.
+     */
+    Options() = default;
+
+    /**
+     * Options constructor that parses command line arguments.
+     * @param argc Argument count
+     * @param argv Argument array
+     */
+    Options(int argc, char **argv) {
+        for (int arg_index = 1; arg_index < argc; ++arg_index)
+            parse(argv[arg_index]);
+    }
+
+    /**
+     * Parse a single key=value argument. Arguments without a value are stored with value "1".
+     * @param argument Argument string
+     */
+    void parse(const std::string &argument) {
+        std::string::size_type key_start = argument.find_first_not_of('-');
+        if (key_start == std::string::npos)
+            return;
+        std::string::size_type separator = argument.find('=', key_start);
+        if (separator == std::string::npos)
+            values[argument.substr(key_start)] = "1";
+        else
+            values[argument.substr(key_start, separator - key_start)] = argument.substr(separator + 1);
+    }
+
+    /**
+     * Set option value.
+     * @param key Option name
+     * @param value Option value
+     */
+    void set(const std::string &key, const std::string &value) {
+        values[key] = value;
+    }
+
+    /**
+     * Copy all values from other options, replacing existing ones.
+     * @param other Options to copy values from
+     */
+    void update(const Options &other) {
+        for (const auto &entry : other.values)
+            values[entry.first] = entry.second;
+    }
+
+    /**
+     * Get all options as key=value arguments, so that they can be passed to another process.
+     * @return Argument strings
+     */
+    std::vector<std::string> arguments() const {
+        std::vector<std::string> argument_list;
+        for (const auto &entry : values)
+            argument_list.push_back(entry.first + "=" + entry.second);
+        return argument_list;
+    }
+
+    /**
+     * Check if option is given.
+     * @param key Option name
+     * @return True if given
+     */
+    bool has(const std::string &key) const {
+        return values.count(key) > 0;
+    }
+
+    /**
+     * Get option value.
+     * @param key Option name
+     * @param default_value Value to return if option is not given
+     * @return Option value
+     */
+    std::string get(const std::string &key, const std::string &default_value = "") const {
+        auto entry = values.find(key);
+        return entry == values.end() ? default_value : entry->second;
+    }
+
+    /**
+     * Get integer option value.
+     * @param key Option name
+     * @param default_value Value to return if option is not given
+     * @return Option value
+     */
+    int getInt(const std::string &key, int default_value) const {
+        return has(key) ? std::stoi(get(key)) : default_value;
+    }
+
+    /**
+     * Get floating-point option value.
+     * @param key Option name
+     * @param default_value Value to return if option is not given
+     * @return Option value
+     */
+    double getDouble(const std::string &key, double default_value) const {
+        return has(key) ? std::stod(get(key)) : default_value;
+    }
+};
+
+#endif //MARS_CI_OPTIONS_H
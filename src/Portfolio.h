@@ -0,0 +1,98 @@
+#ifndef MARS_CI_PORTFOLIO_H
+#define MARS_CI_PORTFOLIO_H
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * Represents successive halving over the runs of a session.
+ * Runs report their energy when they pass rung temperatures. A run goes on only if its energy is among
+ * the best keep_fraction of the energies reported at the rung so far, so every rung stops about
+ * 1 - keep_fraction of the runs that reach it. Runs are compared as they arrive, so no run waits for the others.
+ * Runs that start below a rung temperature skip the rung.
+ */
+class Portfolio {
+private:
+    std::vector<float> rung_temperatures;
+    double keep_fraction;
+    std::mutex portfolio_mutex;
+
+    /**
+     * Energies reported at every rung in ascending order.
+     */
+    std::vector<std::vector<double>> rung_energies;
+    int stopped_count = 0;
+
+public:
+    /**
+     * Portfolio constructor.
+     * @param rung_temperatures Rung temperatures in descending order
+     * @param keep_fraction Fraction of runs that go on at every rung
+     */
+    Portfolio(std::vector<float> rung_temperatures, double keep_fraction);
+
+    /**
+     * Place rungs evenly between the given temperature and zero.
+     * @param max_temperature Highest start temperature of the runs
+     * @param rung_count Quantity of rungs
+     * @return Rung temperatures in descending order
+     */
+    static std::vector<float> evenRungs(float max_temperature, int rung_count);
+
+    /**
+     * Get rung temperatures.
+     * @return Rung temperatures in descending order
+     */
+    const std::vector<float> &rungs() const;
+
+    /**
+     * Report run energy at a rung.
+     * @param rung Rung index
+     * @param energy Run energy
+     * @return True if the run goes on
+     */
+    bool promote(int rung, double energy);
+
+    /**
+     * Get quantity of stopped runs.
+     * @return Stopped run count
+     */
+    int stopped();
+};
+
+Portfolio::Portfolio(std::vector<float> rung_temperatures, double keep_fraction) :
+        rung_temperatures(std::move(rung_temperatures)), keep_fraction(keep_fraction),
+        rung_energies(this->rung_temperatures.size()) {}
+
+std::vector<float> Portfolio::evenRungs(float max_temperature, int rung_count) {
+    std::vector<float> temperatures;
+    for (int rung = 1; rung <= rung_count; ++rung)
+        temperatures.push_back(max_temperature * (float) (rung_count + 1 - rung) / (float) (rung_count + 1));
+    return temperatures;
+}
+
+const std::vector<float> &Portfolio::rungs() const {
+    return rung_temperatures;
+}
+
+bool Portfolio::promote(int rung, double energy) {
+    std::lock_guard<std::mutex> lock(portfolio_mutex);
+    std::vector<double> &energies = rung_energies[rung];
+    auto position = std::upper_bound(energies.begin(), energies.end(), energy);
+    long rank = position - energies.begin();
+    energies.insert(position, energy);
+    if (rank < (long) std::ceil(keep_fraction * (double) energies.size()))
+        return true;
+    stopped_count++;
+    return false;
+}
+
+int Portfolio::stopped() {
+    std::lock_guard<std::mutex> lock(portfolio_mutex);
+    return stopped_count;
+}
+
+#endif //MARS_CI_PORTFOLIO_H
@@ -0,0 +1,272 @@
+#ifndef MARS_CI_REPLICABATCH_H
+#define MARS_CI_REPLICABATCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "AnnealingRun.h"
+#include "lib/Lattice.h"
+#include "lib/Metrics.h"
+
+/**
+ * Represents several annealing runs on the same lattice that are advanced together.
+ * Local fields of all replicas are stored replica-major, as a single replica by spin matrix. Sweeps go through
+ * the spins in tiles: inside a tile the local fields are corrected for the changes made in it with the diagonal
+ * block of the lattice, then the changes of the tile are added to the local fields of all replicas with a rank-k
+ * update (see Lattice::axpyReplicas). So the lattice is streamed once per sweep for all replicas, and the field
+ * matrix once per tile of rows, instead of both once per changed spin of every replica.
+ * The replicas go through the same sweeps as AnnealingRun::anneal, up to the rounding of the local fields.
+ * @tparam T Spin and Lattice element value type
+ */
+template<typename T>
+class ReplicaBatch {
+private:
+    static constexpr double field_tolerance = 1e-5;
+    static constexpr int tile_size = 64;
+
+    const Lattice<T> &lattice;
+    std::vector<AnnealingRun<T>> runs{};
+
+    /**
+     * Local fields and spin values they were computed for, indexed by set index. Values of spin i
+     * in replica r are stored at r * lattice.size() + i.
+     */
+    std::vector<std::vector<double>> local_fields{};
+    std::vector<std::vector<T>> field_values{};
+
+    /**
+     * Differences between spin values and field values in the current tile, stored like field_values.
+     * Zero outside of the tile.
+     */
+    std::vector<T> tile_changes{};
+
+    /**
+     * Compute local fields of all replicas from their current spin values.
+     */
+    void initLocalFields();
+
+    /**
+     * Perform a sweep over all spins of all sets for the given replicas.
+     * @tparam F Interaction formula policy (see Formula.h)
+     * @param sweeping Flags of replicas that take part in the sweep
+     * @param proceed_iteration Flags set for replicas whose spins moved more than the threshold
+     */
+    template<typename F>
+    void sweep(const std::vector<bool> &sweeping, std::vector<bool> &proceed_iteration);
+
+public:
+    /**
+     * ReplicaBatch constructor.
+     * @param lattice Lattice shared by all replicas
+     */
+    explicit ReplicaBatch(const Lattice<T> &lattice) : lattice(lattice) {}
+
+    /**
+     * Add a replica to the batch. All replicas must have blocks with the same set count and use the same formula.
+     * The batch takes over the run and its block.
+     * @param run AnnealingRun object
+     */
+    void add(AnnealingRun<T> &&run);
+
+    /**
+     * Get replica by index.
+     * @param index Replica index
+     * @return AnnealingRun object
+     */
+    AnnealingRun<T> &operator[](int index);
+
+    /**
+     * Get replica count.
+     * @return Replica count
+     */
+    int size();
+
+    /**
+     * Perform a full annealing operation on all replicas.
+     */
+    void anneal();
+};
+
+template<typename T>
+void ReplicaBatch<T>::add(AnnealingRun<T> &&run) {
+    runs.push_back(std::move(run));
+}
+
+template<typename T>
+AnnealingRun<T> &ReplicaBatch<T>::operator[](int index) {
+    return runs[index];
+}
+
+template<typename T>
+int ReplicaBatch<T>::size() {
+    return (int) runs.size();
+}
+
+template<typename T>
+void ReplicaBatch<T>::initLocalFields() {
+    int replica_count = size(), set_size = lattice.size(), set_count = runs[0].block.set_count;
+    local_fields.assign(set_count, std::vector<double>((long) replica_count * set_size, 0));
+    field_values.assign(set_count, std::vector<T>((long) replica_count * set_size));
+    tile_changes.assign((long) replica_count * set_size, 0);
+    std::vector<int> rows;
+    std::vector<double> row_spins;
+    for (int set_index = 0; set_index < set_count; ++set_index) {
+        T *values = field_values[set_index].data();
+        double *fields = local_fields[set_index].data();
+        for (int r = 0; r < replica_count; ++r)
+            for (int i = 0; i < set_size; ++i)
+                values[(long) r * set_size + i] = runs[r].block[set_index][i];
+        // Lattice by spin matrix product, a tile of lattice rows at a time
+        for (int first = 0; first < set_size; first += tile_size) {
+            rows.clear();
+            row_spins.clear();
+            for (int i = first; i < std::min(first + tile_size, set_size); ++i) {
+                rows.push_back(i);
+                for (int r = 0; r < replica_count; ++r)
+                    row_spins.push_back(values[(long) r * set_size + i]);
+            }
+            lattice.axpyReplicas(rows.data(), (int) rows.size(), row_spins.data(), replica_count, fields);
+        }
+        for (int i = 0; i < set_size; ++i) {
+            T diagonal = lattice(i, i);
+            for (int r = 0; r < replica_count; ++r)
+                fields[(long) r * set_size + i] -= values[(long) r * set_size + i] * diagonal;
+        }
+    }
+}
+
+template<typename T>
+template<typename F>
+void ReplicaBatch<T>::sweep(const std::vector<bool> &sweeping, std::vector<bool> &proceed_iteration) {
+    int replica_count = size(), set_size = lattice.size();
+    std::vector<BigFloat> multipliers(replica_count, BigFloat(0));
+    for (int r = 0; r < replica_count; ++r)
+        multipliers[r] = runs[r].currentMultiplier();
+    std::vector<int> rows;
+    std::vector<double> row_changes;
+
+    for (int set_index = 0; set_index < runs[0].block.set_count; ++set_index) {
+        T *values = field_values[set_index].data();
+        double *fields = local_fields[set_index].data();
+        for (int first = 0; first < set_size; first += tile_size) {
+            int last = std::min(first + tile_size, set_size);
+            // Changes that were too small to propagate before are taken into account inside the tile
+            for (int r = 0; r < replica_count; ++r)
+                for (int i = first; i < last; ++i)
+                    tile_changes[(long) r * set_size + i] = runs[r].block[set_index][i] - values[(long) r * set_size + i];
+
+            for (int spin_index = first; spin_index < last; ++spin_index) {
+                T diagonal = lattice(spin_index, spin_index);
+                for (int r = 0; r < replica_count; ++r) {
+                    if (not sweeping[r])
+                        continue;
+                    AnnealingRun<T> &run = runs[r];
+                    T *changes = tile_changes.data() + (long) r * set_size;
+                    double local_field = fields[(long) r * set_size + spin_index] +
+                                         lattice.dot(spin_index, changes, first, last) -
+                                         (double) changes[spin_index] * diagonal;
+                    BigFloat mean_field = run.block[set_index].template meanField<F>(spin_index, local_field,
+                                                                                      multipliers[r]);
+                    T target_value = run.spinValue(mean_field), old_spin_value = run.block[set_index][spin_index];
+                    if (fabs(target_value - old_spin_value) > threshold)
+                        proceed_iteration[r] = true;
+                    T new_spin_value = run.relaxedValue(old_spin_value, target_value);
+                    run.block.setSpin(set_index, spin_index, new_spin_value);
+                    changes[spin_index] = new_spin_value - values[(long) r * set_size + spin_index];
+                }
+            }
+
+            // Spins changed by at least the tolerance in some replica are propagated to the local fields
+            // of all replicas, negligible changes stay pending until they accumulate
+            rows.clear();
+            row_changes.clear();
+            for (int i = first; i < last; ++i) {
+                bool propagate = false;
+                for (int r = 0; r < replica_count; ++r)
+                    propagate |= std::fabs(tile_changes[(long) r * set_size + i]) >= field_tolerance;
+                if (not propagate)
+                    continue;
+                rows.push_back(i);
+                for (int r = 0; r < replica_count; ++r) {
+                    row_changes.push_back(tile_changes[(long) r * set_size + i]);
+                    values[(long) r * set_size + i] = runs[r].block[set_index][i];
+                }
+            }
+            for (int r = 0; r < replica_count; ++r)
+                std::fill(tile_changes.begin() + (long) r * set_size + first,
+                          tile_changes.begin() + (long) r * set_size + last, 0);
+            if (rows.empty())
+                continue;
+            lattice.axpyReplicas(rows.data(), (int) rows.size(), row_changes.data(), replica_count, fields);
+            for (unsigned int t = 0; t < rows.size(); ++t) {
+                T diagonal = lattice(rows[t], rows[t]);
+                for (int r = 0; r < replica_count; ++r)
+                    fields[(long) r * set_size + rows[t]] -= row_changes[t * replica_count + r] * diagonal;
+            }
+        }
+    }
+}
+
+template<typename T>
+void ReplicaBatch<T>::anneal() {
+    if (runs.empty())
+        return;
+    // Probabilities are kept up to date by setSpin from now on
+    for (AnnealingRun<T> &run : runs)
+        for (int set_index = 0; set_index < run.block.set_count; ++set_index)
+            for (int link_index = 0; link_index < run.block[set_index].linkedSets(); ++link_index)
+                run.block[set_index].recalculateProbabilities(link_index);
+    initLocalFields();
+    int replica_count = size();
+    std::vector<bool> annealing(replica_count), sweeping(replica_count), proceed_iteration(replica_count);
+    std::vector<int> level_sweeps(replica_count, 0);
+    while (true) {
+        // Start next temperature level of every replica that is still above zero
+        bool any_annealing = false;
+        for (int r = 0; r < replica_count; ++r) {
+            annealing[r] = runs[r].temperature > 0 and not runs[r].stopped;
+            if (annealing[r]) {
+                runs[r].lowerTemperature(level_sweeps[r]);
+                level_sweeps[r] = 0;
+            }
+            any_annealing |= annealing[r];
+        }
+        if (not any_annealing)
+            return;
+
+        // Sweep until every replica converges on its level
+        auto level_start = std::chrono::steady_clock::now();
+        sweeping = annealing;
+        bool any_sweeping = true;
+        while (any_sweeping) {
+            proceed_iteration.assign(replica_count, false);
+            if (runs[0].formula == FORMULA_ASYM)
+                sweep<AsymmetricFormula>(sweeping, proceed_iteration);
+            else
+                sweep<SymmetricFormula>(sweeping, proceed_iteration);
+            any_sweeping = false;
+            for (int r = 0; r < replica_count; ++r) {
+                if (not sweeping[r])
+                    continue;
+                runs[r].step_counter++;
+                level_sweeps[r]++;
+                sweeping[r] = proceed_iteration[r];
+                any_sweeping |= sweeping[r];
+            }
+        }
+        Metrics::annealingTime(Metrics::since(level_start));
+        for (int r = 0; r < replica_count; ++r) {
+            if (not annealing[r])
+                continue;
+            Metrics::levelFinished(runs[r].temperature, level_sweeps[r],
+                                   (long) level_sweeps[r] * runs[r].block.set_count * runs[r].block.setSize());
+            if (runs[r].level_finished)
+                runs[r].level_finished(runs[r]);
+        }
+    }
+}
+
+#endif //MARS_CI_REPLICABATCH_H
@@ -0,0 +1,226 @@
+#ifndef MARS_CI_REPLICAEXCHANGE_H
+#define MARS_CI_REPLICAEXCHANGE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "AnnealingRun.h"
+#include "lib/Random.h"
+#include "lib/ThreadPool.h"
+
+/**
+ * Represents parallel tempering over the temperatures of several runs.
+ * Runs are placed on a ladder of rungs by their start temperatures. In every round each run converges at the
+ * temperature of its rung, then runs on neighbouring rungs attempt to swap rungs with the Metropolis criterion
+ * on their energies; even and odd rung pairs alternate between rounds. After the last round every run is
+ * handed to the rounds_finished callback, which anneals it down from the temperature it has reached.
+ * Runs are advanced by thread pool jobs. The run that converges first in a pair leaves its worker, the second
+ * one makes the exchange and continues both, so no worker waits for another.
+ * Exchange decisions are taken from random streams keyed by rung pair and round, so the results do not depend
+ * on thread count or scheduling.
+ * @tparam T Spin and Lattice element value type
+ */
+template<typename T>
+class ReplicaExchange {
+public:
+    /**
+     * Function called with a run and its index once the run has made all exchange rounds.
+     */
+    typedef std::function<void(AnnealingRun<T> &, int)> FinishCallback;
+
+private:
+    ThreadPool &pool;
+    int round_count;
+    std::vector<AnnealingRun<T>> runs{};
+    FinishCallback rounds_finished{};
+
+    /**
+     * Rung of every run, run at every rung (rung 0 is the hottest) and quantity of rounds made by every run.
+     */
+    std::vector<int> run_rungs{}, rung_runs{}, run_rounds{};
+
+    /**
+     * Energy of every run at the end of its last round.
+     */
+    std::vector<double> run_energies{};
+
+    /**
+     * Quantity of runs that arrived at every pair of rungs k and k + 1 in the current round of the pair.
+     */
+    std::unique_ptr<std::atomic<int>[]> pair_arrivals{};
+    std::atomic<long> attempted_swaps{0}, accepted_swaps{0};
+
+    /**
+     * Get energy of a run: the sum of the Hamiltonians of its annealed sets.
+     * @param run AnnealingRun object
+     * @return Energy value
+     */
+    static double energy(AnnealingRun<T> &run);
+
+    /**
+     * Attempt to swap the runs on a pair of rungs.
+     * @param pair Index of the hotter rung
+     * @param round Round index
+     */
+    void exchange(int pair, int round);
+
+    /**
+     * Make exchange rounds of a run until it has to wait for its pair or has made all of them.
+     * @param run_index Run index
+     */
+    void advance(int run_index);
+
+public:
+    /**
+     * ReplicaExchange constructor.
+     * @param pool Thread pool that advances the runs
+     * @param round_count Quantity of exchange rounds
+     */
+    ReplicaExchange(ThreadPool &pool, int round_count) : pool(pool), round_count(round_count) {}
+
+    /**
+     * Add a run to the exchange. The exchange takes over the run and its block.
+     * @param run AnnealingRun object
+     */
+    void add(AnnealingRun<T> &&run);
+
+    /**
+     * Get run by index.
+     * @param index Run index
+     * @return AnnealingRun object
+     */
+    AnnealingRun<T> &operator[](int index);
+
+    /**
+     * Get run count.
+     * @return Run count
+     */
+    int size();
+
+    /**
+     * Place the runs on the ladder and submit them to the thread pool.
+     * The exchange must live until rounds_finished has been called for every run.
+     * @param rounds_finished Function called on a worker for every run after its last round
+     */
+    void start(FinishCallback rounds_finished);
+
+    /**
+     * Get quantity of attempted swaps.
+     * @return Attempt count
+     */
+    long attempted();
+
+    /**
+     * Get quantity of accepted swaps.
+     * @return Swap count
+     */
+    long accepted();
+};
+
+template<typename T>
+double ReplicaExchange<T>::energy(AnnealingRun<T> &run) {
+    double energy = 0;
+    for (int set_index = 0; set_index < run.block.set_count; ++set_index)
+        if (run[set_index].set_type != NO_ANNEAL)
+            energy += run[set_index].energy(run.lattice);
+    return energy;
+}
+
+template<typename T>
+void ReplicaExchange<T>::exchange(int pair, int round) {
+    int hot_run = rung_runs[pair], cold_run = rung_runs[pair + 1];
+    AnnealingRun<T> &hot = runs[hot_run], &cold = runs[cold_run];
+    // Swap is accepted with probability min(1, exp((1 / T_cold - 1 / T_hot) * (E_cold - E_hot)))
+    double exponent = (1. / cold.temperature - 1. / hot.temperature) *
+                      (run_energies[cold_run] - run_energies[hot_run]);
+    Random::Stream stream(pair, Random::EXCHANGE_STREAM);
+    stream.seek(round);
+    double threshold = stream.uniform(0, 1);
+    attempted_swaps++;
+    if (not(exponent >= 0 or threshold < std::exp(exponent)))
+        return;
+    accepted_swaps++;
+    std::swap(hot.temperature, cold.temperature);
+    std::swap(rung_runs[pair], rung_runs[pair + 1]);
+    run_rungs[hot_run] = pair + 1;
+    run_rungs[cold_run] = pair;
+}
+
+template<typename T>
+void ReplicaExchange<T>::advance(int run_index) {
+    AnnealingRun<T> &run = runs[run_index];
+    if (run_rounds[run_index] == 0)
+        run.prepare();
+    while (run_rounds[run_index] < round_count) {
+        run.annealingStep();
+        run_energies[run_index] = energy(run);
+        int round = run_rounds[run_index]++, rung = run_rungs[run_index];
+        int pair = rung % 2 == round % 2 ? rung : rung - 1;
+        if (pair < 0 or pair + 1 >= size())
+            // Rung has no pair in this round
+            continue;
+        if (pair_arrivals[pair].fetch_add(1) == 0)
+            // The other run of the pair continues both
+            return;
+        pair_arrivals[pair] = 0;
+        exchange(pair, round);
+        int partner = rung_runs[pair] == run_index ? rung_runs[pair + 1] : rung_runs[pair];
+        pool.submit([this, partner] { advance(partner); });
+    }
+    rounds_finished(run, run_index);
+}
+
+template<typename T>
+void ReplicaExchange<T>::add(AnnealingRun<T> &&run) {
+    runs.push_back(std::move(run));
+}
+
+template<typename T>
+AnnealingRun<T> &ReplicaExchange<T>::operator[](int index) {
+    return runs[index];
+}
+
+template<typename T>
+int ReplicaExchange<T>::size() {
+    return (int) runs.size();
+}
+
+template<typename T>
+void ReplicaExchange<T>::start(FinishCallback finished) {
+    rounds_finished = std::move(finished);
+    int run_count = size();
+    rung_runs.resize(run_count);
+    for (int run_index = 0; run_index < run_count; ++run_index)
+        rung_runs[run_index] = run_index;
+    std::stable_sort(rung_runs.begin(), rung_runs.end(), [this](int first, int second) {
+        return runs[first].temperature > runs[second].temperature;
+    });
+    run_rungs.resize(run_count);
+    for (int rung = 0; rung < run_count; ++rung)
+        run_rungs[rung_runs[rung]] = rung;
+    run_rounds.assign(run_count, 0);
+    run_energies.assign(run_count, 0);
+    pair_arrivals.reset(new std::atomic<int>[std::max(1, run_count)]());
+    // Hottest runs converge slowest, so they are submitted first
+    for (int rung = 0; rung < run_count; ++rung) {
+        int run_index = rung_runs[rung];
+        pool.submit([this, run_index] { advance(run_index); });
+    }
+}
+
+template<typename T>
+long ReplicaExchange<T>::attempted() {
+    return attempted_swaps;
+}
+
+template<typename T>
+long ReplicaExchange<T>::accepted() {
+    return accepted_swaps;
+}
+
+#endif //MARS_CI_REPLICAEXCHANGE_H
@@ -0,0 +1,183 @@
+#ifndef MARS_CI_SERVER_H
+#define MARS_CI_SERVER_H
+
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Options.h"
+
+/**
+ * Represents a server that accepts job requests on a local Unix domain socket.
+ * A client sends session parameters as key=value words in the session config file format, finished
+ * by a config_end line or by shutting down its side of the connection. Output lines of the job are
+ * written back as soon as they are produced, the connection is closed when the job is finished.
+ * Every connection is served by its own thread.
+ */
+class Server {
+public:
+    /**
+     * Function that writes a single output line to the client.
+     */
+    typedef std::function<void(const std::string &)> LineWriter;
+
+    /**
+     * Function that processes a job request.
+     */
+    typedef std::function<void(const Options &, const LineWriter &)> Handler;
+
+private:
+    std::string socket_path;
+    Handler handler;
+    int listen_fd = -1;
+
+    /**
+     * Connection state shared by the request handler and the output writer.
+     */
+    struct Connection {
+        int fd;
+        std::mutex write_mutex{};
+        bool open = true;
+
+        explicit Connection(int fd) : fd(fd) {}
+
+        ~Connection() { close(fd); }
+    };
+
+    /**
+     * Read job request from a connection.
+     * @param fd Connection file descriptor
+     * @param request Options to store request parameters in
+     */
+    static void readRequest(int fd, Options &request);
+
+    /**
+     * Write a line to the client, drop the output if the client has disconnected.
+     * @param connection Connection object
+     * @param line Line without line break
+     */
+    static void writeLine(Connection &connection, const std::string &line);
+
+    /**
+     * Serve a single connection.
+     * @param connection Connection object
+     */
+    void serve(const std::shared_ptr<Connection> &connection);
+
+public:
+    /**
+     * Server constructor. Creates the socket, replacing an existing file at the socket path.
+     * @param socket_path Socket file path
+     * @param handler Job request handler
+     */
+    Server(const std::string &socket_path, Handler handler);
+
+    ~Server();
+
+    /**
+     * Accept connections until the socket fails.
+     */
+    void run();
+};
+
+Server::Server(const std::string &_socket_path, Server::Handler _handler) :
+        socket_path(_socket_path), handler(std::move(_handler)) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+        throw std::invalid_argument("Socket path is too long: " + socket_path);
+    socket_path.copy(address.sun_path, socket_path.size());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        throw std::runtime_error("Failed to create socket");
+    unlink(socket_path.c_str());
+    if (bind(listen_fd, (const sockaddr *) &address, sizeof(address)) != 0 or listen(listen_fd, SOMAXCONN) != 0) {
+        close(listen_fd);
+        throw std::runtime_error("Failed to listen on socket " + socket_path);
+    }
+}
+
+Server::~Server() {
+    close(listen_fd);
+    unlink(socket_path.c_str());
+}
+
+void Server::run() {
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR or errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        auto connection = std::make_shared<Connection>(fd);
+        std::thread([this, connection] { serve(connection); }).detach();
+    }
+}
+
+void Server::readRequest(int fd, Options &request) {
+    std::string pending;
+    char buffer[4096];
+    while (true) {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length < 0 and errno == EINTR)
+            continue;
+        bool finished = length <= 0;
+        if (not finished)
+            pending.append(buffer, (size_t) length);
+        std::string::size_type line_end;
+        while ((line_end = pending.find('\n')) != std::string::npos or (finished and not pending.empty())) {
+            if (line_end == std::string::npos)
+                line_end = pending.size();
+            std::string line = pending.substr(0, line_end);
+            pending.erase(0, line_end + 1);
+            if (line.compare(0, 10, "config_end") == 0 or line.compare(0, 11, "session_end") == 0)
+                return;
+            std::stringstream line_parser(line);
+            std::string word;
+            while (line_parser >> word)
+                if (word.find('=') != std::string::npos)
+                    request.parse(word);
+        }
+        if (finished)
+            return;
+    }
+}
+
+void Server::writeLine(Server::Connection &connection, const std::string &line) {
+    std::lock_guard<std::mutex> lock(connection.write_mutex);
+    std::string data = line + "\n";
+    for (size_t offset = 0; connection.open and offset < data.size();) {
+        ssize_t length = send(connection.fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+        if (length < 0 and errno == EINTR)
+            continue;
+        if (length <= 0)
+            connection.open = false;
+        else
+            offset += (size_t) length;
+    }
+}
+
+void Server::serve(const std::shared_ptr<Connection> &connection) {
+    Options request;
+    readRequest(connection->fd, request);
+    LineWriter write_line = [connection](const std::string &line) { writeLine(*connection, line); };
+    try {
+        handler(request, write_line);
+        write_line("Finished");
+    } catch (std::exception &e) {
+        write_line(std::string("Error: ") + e.what());
+    }
+}
+
+#endif //MARS_CI_SERVER_H
@@ -0,0 +1,488 @@
+#ifndef MARS_CI_SESSION_H
+#define MARS_CI_SESSION_H
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "lib/Lattice.h"
+#include "lib/LatticeFile.h"
+#include "lib/Random.h"
+#include "BlockTemplate.h"
+#include "Options.h"
+#include "SweepTeam.h"
+
+/**
+ * Represents parameters of a single program session.
+ * Parameter names match the aliases used in MARS_CI.py session config files.
+ */
+struct Session {
+    float temp_start = 6, temp_final = 8.5, annealing_step = 0.1;
+    std::string lattice_initializer = "1000";
+    int threads = 1;
+    std::string block_filename = "4";
+    int block_count = 50;
+    std::string links_filename = "/home/alexander/CLionProjects/MARS_2/link";
+    double mul_log = -2;
+    float temp_interaction_threshold = 3;
+    std::string results_filename = "/home/alexander/CLionProjects/MARS_2/results.txt";
+
+    // Optional parameters that are given as command line options
+    int replica_count = 1;
+    bool results_binary = false;
+    std::string checkpoint_dir{};
+    double checkpoint_interval = 60;
+    bool resume = false;
+    int team_size = 1;
+    SweepMode sweep_mode = HYBRID;
+    float relaxation = 1;
+    bool adaptive_schedule = false;
+    float step_min = 0, step_max = 0;
+    int portfolio_rungs = 0;
+    double portfolio_keep = 0.5;
+    std::string energy_trace{};
+    std::string lattice_storage = "native";
+    FormulaType formula = FORMULA_SYM;
+    int exchange_rounds = 0;
+    int shard_index = 0, shard_count = 1;
+    int shard_processes = 0;
+    std::string lattice_shared{};
+
+    /**
+     * Default Session constructor.
+     */
+    Session() = default;
+
+    /**
+     * Session constructor that takes parameters from options.
+     * @param options Options containing all parameters listed by Session::keys
+     */
+    explicit Session(const Options &options);
+
+    /**
+     * Get names of the required session parameters in the order the program asks for them.
+     * @return Parameter names
+     */
+    static const std::vector<std::string> &keys();
+
+    /**
+     * Take optional parameters from options.
+     * @param options Options object
+     * @throws std::invalid_argument if a parameter value is out of range
+     */
+    void setOptional(const Options &options);
+
+    /**
+     * Get a key that identifies the parameters the runs of the session depend on.
+     * @return Key value
+     */
+    uint64_t runKey() const;
+
+    /**
+     * Get the parameters listed by Session::keys as options.
+     * @return Options object
+     */
+    Options toOptions() const;
+
+    /**
+     * Load session configs from a MARS_CI.py session config file.
+     * Parameters are given as key=value words; a line starting with config_end or session_end finishes
+     * the current config, an optional third word of that line sets how many times it is repeated.
+     * @param filename Config filename
+     * @param overrides Options that replace parameters of every config
+     * @return Session configs
+     */
+    static std::vector<Options> loadConfig(const std::string &filename, const Options &overrides);
+};
+
+Session::Session(const Options &options) {
+    for (const std::string &key : keys())
+        if (not options.has(key))
+            throw std::invalid_argument("Missing parameter definition for '" + key + "'");
+    temp_start = (float) options.getDouble("start", temp_start);
+    temp_final = (float) options.getDouble("end", temp_final);
+    annealing_step = (float) options.getDouble("step", annealing_step);
+    lattice_initializer = options.get("lat_arg");
+    threads = options.getInt("threads", threads);
+    block_filename = options.get("block_data");
+    block_count = options.getInt("block_qty", block_count);
+    links_filename = options.get("links");
+    mul_log = options.getDouble("int_q", mul_log);
+    temp_interaction_threshold = (float) options.getDouble("temp_threshold", temp_interaction_threshold);
+    results_filename = options.get("results");
+    setOptional(options);
+}
+
+void Session::setOptional(const Options &options) {
+    replica_count = options.getInt("replicas", replica_count);
+    results_binary = options.get("results_format", "text") == "binary";
+    checkpoint_dir = options.get("checkpoint", checkpoint_dir);
+    checkpoint_interval = options.getDouble("checkpoint_interval", checkpoint_interval);
+    resume = options.getInt("resume", resume) != 0;
+    team_size = options.getInt("team", team_size);
+    sweep_mode = options.get("team_mode", "hybrid") == "jacobi" ? JACOBI : HYBRID;
+    relaxation = (float) options.getDouble("relaxation", relaxation);
+    adaptive_schedule = options.get("schedule", "fixed") == "adaptive";
+    step_min = (float) options.getDouble("step_min", step_min);
+    step_max = (float) options.getDouble("step_max", step_max);
+    portfolio_rungs = options.getInt("portfolio", portfolio_rungs);
+    portfolio_keep = options.getDouble("portfolio_keep", portfolio_keep);
+    energy_trace = options.get("energy_trace", energy_trace);
+    lattice_storage = options.get("lattice_storage", lattice_storage);
+    formula = options.get("formula", "sym") == "asym" ? FORMULA_ASYM : FORMULA_SYM;
+    exchange_rounds = options.getInt("exchange", exchange_rounds);
+    std::string shard = options.get("shard");
+    if (not shard.empty()) {
+        std::string::size_type separator = shard.find('/');
+        if (separator == std::string::npos)
+            throw std::invalid_argument("Shard must be given as index/count");
+        shard_index = std::stoi(shard.substr(0, separator));
+        shard_count = std::stoi(shard.substr(separator + 1));
+    }
+    shard_processes = options.getInt("shards", shard_processes);
+    lattice_shared = options.get("lattice_shm", lattice_shared);
+    if (relaxation <= 0 or relaxation >= 2)
+        throw std::invalid_argument("Relaxation factor must be between 0 and 2");
+    if (portfolio_keep <= 0 or portfolio_keep > 1)
+        throw std::invalid_argument("Portfolio keep fraction must be between 0 and 1");
+    if (shard_count < 1 or shard_index < 0 or shard_index >= shard_count)
+        throw std::invalid_argument("Shard index must be between 0 and shard count");
+    if (lattice_storage != "native")
+        LatticeFile::parseType(lattice_storage);
+}
+
+uint64_t Session::runKey() const {
+    std::ostringstream oss;
+    oss << temp_start << " " << temp_final << " " << annealing_step << " " << lattice_initializer << " "
+        << block_filename << " " << block_count << " " << links_filename << " " << mul_log << " "
+        << temp_interaction_threshold << " " << relaxation << " " << adaptive_schedule << " " << step_min << " "
+        << step_max << " " << lattice_storage << " " << formula << " " << exchange_rounds << " "
+        << Random::globalSeed();
+    std::string parameters = oss.str();
+    return LatticeFile::checksum(LatticeFile::CHECKSUM_SEED, parameters.data(), parameters.size());
+}
+
+Options Session::toOptions() const {
+    auto format = [](double value) {
+        std::ostringstream oss;
+        oss.precision(std::numeric_limits<double>::max_digits10);
+        oss << value;
+        return oss.str();
+    };
+    Options options;
+    options.set("start", format(temp_start));
+    options.set("end", format(temp_final));
+    options.set("step", format(annealing_step));
+    options.set("lat_arg", lattice_initializer);
+    options.set("threads", std::to_string(threads));
+    options.set("block_data", block_filename);
+    options.set("block_qty", std::to_string(block_count));
+    options.set("links", links_filename);
+    options.set("int_q", format(mul_log));
+    options.set("temp_threshold", format(temp_interaction_threshold));
+    options.set("results", results_filename);
+    return options;
+}
+
+const std::vector<std::string> &Session::keys() {
+    static const std::vector<std::string> session_keys = {
+            "start", "end", "step", "lat_arg", "threads", "block_data", "block_qty", "links", "int_q",
+            "temp_threshold", "results"};
+    return session_keys;
+}
+
+std::vector<Options> Session::loadConfig(const std::string &filename, const Options &overrides) {
+    std::ifstream ifs(filename);
+    if (not ifs.good())
+        throw std::runtime_error("Cannot open session config file " + filename);
+    std::vector<Options> configs;
+    Options config;
+    bool config_empty = true;
+    std::string line;
+    while (getline(ifs, line)) {
+        std::stringstream line_parser(line);
+        std::vector<std::string> words;
+        std::string word;
+        while (line_parser >> word)
+            words.push_back(word);
+        if (line.compare(0, 10, "config_end") == 0 or line.compare(0, 11, "session_end") == 0) {
+            int repeat = 1;
+            try {
+                if (words.size() > 2)
+                    repeat = std::stoi(words[2]);
+            } catch (std::exception &e) {
+                // Repeat number not specified
+            }
+            config.update(overrides);
+            configs.insert(configs.end(), repeat, config);
+            config = Options();
+            config_empty = true;
+            continue;
+        }
+        for (const std::string &line_word : words) {
+            if (line_word.find('=') == std::string::npos)
+                continue;
+            config.parse(line_word);
+            config_empty = false;
+        }
+    }
+    if (not config_empty) {
+        config.update(overrides);
+        configs.push_back(config);
+    }
+    return configs;
+}
+
+/**
+ * Keeps lattices and block templates loaded by previous sessions.
+ * Objects are identified by the parameters they were loaded with and by modification time of the files
+ * they were loaded from, so every file is parsed only once while it is unchanged.
+ * If capacity is limited, least recently used objects are evicted; sessions that still use them keep them alive.
+ * @tparam T Spin and Lattice element value type
+ */
+template<typename T>
+class SessionCache {
+private:
+    /**
+     * Object that is loaded or being loaded. Sessions that need an object while it is loading wait for it.
+     */
+    template<typename V>
+    using Loading = std::shared_future<std::shared_ptr<V>>;
+
+    /**
+     * Objects of a single kind ordered from the most recently used to the least recently used one.
+     */
+    template<typename V>
+    struct Entries {
+        typedef std::list<std::pair<std::string, Loading<V>>> EntryList;
+        EntryList entries{};
+        std::map<std::string, typename EntryList::iterator> index{};
+
+        Loading<V> find(const std::string &key) {
+            auto entry = index.find(key);
+            if (entry == index.end())
+                return Loading<V>();
+            entries.splice(entries.begin(), entries, entry->second);
+            return entry->second->second;
+        }
+
+        Loading<V> erase(const std::string &key) {
+            auto entry = index.find(key);
+            if (entry == index.end())
+                return Loading<V>();
+            Loading<V> value = entry->second->second;
+            entries.erase(entry->second);
+            index.erase(entry);
+            return value;
+        }
+
+        void insert(const std::string &key, const Loading<V> &value, unsigned int capacity) {
+            erase(key);
+            entries.emplace_front(key, value);
+            index[key] = entries.begin();
+            while (capacity > 0 and entries.size() > capacity) {
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+        }
+    };
+
+    unsigned int capacity;
+    std::mutex cache_mutex;
+    Entries<Lattice<T>> lattices{};
+    Entries<BlockTemplate<T>> block_templates{};
+
+    /**
+     * Make cache key of a parameter that may be a file path.
+     * @param argument Parameter value
+     * @return Parameter value followed by file modification time if the file exists
+     */
+    static std::string fileKey(const std::string &argument);
+
+    /**
+     * Make cache key of a lattice.
+     * @param lattice_initializer Lattice file path or size of a random lattice
+     * @param lattice_storage Storage type name
+     * @return Cache key
+     */
+    static std::string latticeKey(const std::string &lattice_initializer, const std::string &lattice_storage);
+
+    /**
+     * Check if an object has failed to load.
+     * @param value Cached object
+     * @return True if loading has finished with an exception
+     */
+    template<typename V>
+    static bool failed(const Loading<V> &value);
+
+    /**
+     * Get a cached object, load it if it is not loaded yet. The cache is not locked while the object loads,
+     * so sessions that use other objects are not held up; sessions that need the same one wait for it.
+     * Objects that failed to load are loaded again.
+     * @param entries Cached objects of the kind
+     * @param key Cache key
+     * @param load_value Function that loads the object
+     * @return Object
+     */
+    template<typename V, typename F>
+    std::shared_ptr<V> cached(Entries<V> &entries, const std::string &key, F load_value);
+
+public:
+    /**
+     * SessionCache constructor.
+     * @param capacity Maximal quantity of objects of each kind, 0 for unlimited
+     */
+    explicit SessionCache(unsigned int capacity = 0) : capacity(capacity) {}
+
+    /**
+     * Load lattice without keeping it in a cache.
+     * @param lattice_initializer Lattice file path or size of a random lattice
+     * @param lattice_storage Storage type name (see LatticeFile::parseType), native to keep the loaded one
+     * @return Lattice object
+     */
+    static std::shared_ptr<Lattice<T>> load(const std::string &lattice_initializer,
+                                            const std::string &lattice_storage = "native");
+
+    /**
+     * Get lattice, load it if it is not loaded yet.
+     * @param lattice_initializer Lattice file path or size of a random lattice
+     * @param lattice_storage Storage type name (see LatticeFile::parseType), native to keep the loaded one
+     * @return Lattice object
+     */
+    std::shared_ptr<Lattice<T>> lattice(const std::string &lattice_initializer,
+                                        const std::string &lattice_storage = "native");
+
+    /**
+     * Get lattice and remove it from the cache, load it without caching if it is not loaded.
+     * The lattice is freed as soon as the caller and the sessions that use it release it.
+     * @param lattice_initializer Lattice file path or size of a random lattice
+     * @param lattice_storage Storage type name (see LatticeFile::parseType), native to keep the loaded one
+     * @return Lattice object
+     */
+    std::shared_ptr<Lattice<T>> takeLattice(const std::string &lattice_initializer,
+                                            const std::string &lattice_storage = "native");
+
+    /**
+     * Get block template, load it if it is not loaded yet.
+     * @param set_size Size of sets in block
+     * @param block_filename Block file path or block size of a random block
+     * @param links_filename Links file path
+     * @return BlockTemplate object
+     */
+    std::shared_ptr<BlockTemplate<T>> blockTemplate(int set_size, const std::string &block_filename,
+                                                    const std::string &links_filename);
+};
+
+template<typename T>
+std::string SessionCache<T>::fileKey(const std::string &argument) {
+    struct stat file_stat{};
+    if (stat(argument.c_str(), &file_stat) != 0)
+        return argument;
+    return argument + "@" + std::to_string(file_stat.st_mtim.tv_sec) + "." + std::to_string(file_stat.st_mtim.tv_nsec);
+}
+
+template<typename T>
+std::string SessionCache<T>::latticeKey(const std::string &lattice_initializer, const std::string &lattice_storage) {
+    return fileKey(lattice_initializer) + "\n" + lattice_storage;
+}
+
+template<typename T>
+template<typename V>
+bool SessionCache<T>::failed(const Loading<V> &value) {
+    if (value.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return false;
+    try {
+        value.get();
+    } catch (std::exception &e) {
+        return true;
+    }
+    return false;
+}
+
+template<typename T>
+template<typename V, typename F>
+std::shared_ptr<V> SessionCache<T>::cached(Entries<V> &entries, const std::string &key, F load_value) {
+    std::promise<std::shared_ptr<V>> promise;
+    Loading<V> value;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        value = entries.find(key);
+        if (value.valid() and not failed(value))
+            return value.get();
+        value = promise.get_future().share();
+        entries.insert(key, value, capacity);
+    }
+    try {
+        promise.set_value(load_value());
+    } catch (std::exception &e) {
+        promise.set_exception(std::current_exception());
+    }
+    return value.get();
+}
+
+template<typename T>
+std::shared_ptr<Lattice<T>> SessionCache<T>::lattice(const std::string &lattice_initializer,
+                                                     const std::string &lattice_storage) {
+    return cached(lattices, latticeKey(lattice_initializer, lattice_storage), [&] {
+        return load(lattice_initializer, lattice_storage);
+    });
+}
+
+template<typename T>
+std::shared_ptr<Lattice<T>> SessionCache<T>::takeLattice(const std::string &lattice_initializer,
+                                                         const std::string &lattice_storage) {
+    Loading<Lattice<T>> lattice;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        lattice = lattices.erase(latticeKey(lattice_initializer, lattice_storage));
+    }
+    // A lattice that is still loading is waited for
+    if (lattice.valid() and not failed(lattice))
+        return lattice.get();
+    return load(lattice_initializer, lattice_storage);
+}
+
+template<typename T>
+std::shared_ptr<Lattice<T>> SessionCache<T>::load(const std::string &lattice_initializer,
+                                                  const std::string &lattice_storage) {
+    std::shared_ptr<Lattice<T>> lattice;
+    try {
+        // User entered size
+        lattice = std::make_shared<Lattice<T>>(std::stoi(lattice_initializer), true);
+    }
+    catch (std::exception &e) {
+        // User entered path
+        lattice = std::make_shared<Lattice<T>>(lattice_initializer);
+    }
+    if (lattice_storage != "native")
+        lattice = std::make_shared<Lattice<T>>(lattice->pack(LatticeFile::parseType(lattice_storage)));
+    return lattice;
+}
+
+template<typename T>
+std::shared_ptr<BlockTemplate<T>> SessionCache<T>::blockTemplate(int set_size, const std::string &block_filename,
+                                                                 const std::string &links_filename) {
+    std::string key = std::to_string(set_size) + "\n" + fileKey(block_filename) + "\n" + fileKey(links_filename);
+    return cached(block_templates, key, [&] {
+        try {
+            int block_size = stoi(block_filename);
+            return std::make_shared<BlockTemplate<T>>(set_size, block_size, links_filename);
+        } catch (std::exception &e) {
+            return std::make_shared<BlockTemplate<T>>(set_size, block_filename, links_filename);
+        }
+    });
+}
+
+#endif //MARS_CI_SESSION_H
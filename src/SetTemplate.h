@@ -5,7 +5,10 @@
 #ifndef MARS_CI_SETTEMPLATE_H
 #define MARS_CI_SETTEMPLATE_H
 
+#include <algorithm>
 #include <sstream>
+#include <vector>
+#include "lib/Random.h"
 #include "lib/Set.h"
 
 /**
@@ -16,11 +19,14 @@
 template<typename T>
 class SetTemplate {
 public:
+    virtual ~SetTemplate() = default;
+
     /**
-     * Create a Set object that matches the template represented by this.
-     * @return Set object
+     * Fill spin values of a set so that it matches the template represented by this.
+     * @param set_values Spin value array of the set
+     * @param stream Random stream dedicated to this set
      */
-    virtual Set<T> instance() = 0;
+    virtual void fill(T *set_values, Random::Stream &stream) = 0;
 };
 
 /**
@@ -31,7 +37,7 @@ template<typename T>
 class GivenSetTemplate : public SetTemplate<T> {
 private:
     int set_size = 0;
-    T *set_values = nullptr;
+    std::vector<T> set_values{};
 
 public:
     /**
@@ -39,7 +45,7 @@ public:
      * @param size Spin count in set
      * @param line String with spin values
      */
-    GivenSetTemplate(int size, const std::string &line) : set_size(size), set_values(new T[size]) {
+    GivenSetTemplate(int size, const std::string &line) : set_size(size), set_values(size) {
         auto in = std::istringstream(line);
         for (int i = 0; i < set_size; ++i) {
             T buf;
@@ -49,11 +55,12 @@ public:
     }
 
     /**
-     * Create a Set object that matches the template represented by this.
-     * @return Set object
+     * Copy template spin values to a set.
+     * @param values Spin value array of the set
+     * @param stream Random stream dedicated to this set, not used
      */
-    Set<T> instance() {
-        return Set<T>(set_size, set_values, UNDEFINED);
+    void fill(T *values, Random::Stream &) override {
+        std::copy(set_values.begin(), set_values.end(), values);
     }
 };
 
@@ -69,14 +76,12 @@ public:
     explicit RandomSetTemplate(int size) : set_size(size) {};
 
     /**
-     * Create a Set object that matches the template represented by this.
-     * @return Set object
+     * Fill a set with random spin values.
+     * @param set_values Spin value array of the set
+     * @param stream Random stream dedicated to this set
      */
-    Set<T> instance() {
-        T *set_values = new T[set_size];
-        for (int i = 0; i < set_size; ++i)
-            set_values[i] = Random::uniform(-1, 1);
-        return Set<T>(set_size, set_values, UNDEFINED);
+    void fill(T *set_values, Random::Stream &stream) override {
+        stream.fill(set_values, set_size, -1, 1);
     }
 };
 
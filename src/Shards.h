@@ -0,0 +1,275 @@
+#ifndef MARS_CI_SHARDS_H
+#define MARS_CI_SHARDS_H
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lib/AsyncWriter.h"
+#include "Options.h"
+
+/**
+ * Runs a session in several worker processes, each of which anneals every shard_count-th group of runs.
+ * Worker processes are started from the same executable with the shard option. A dense lattice is placed
+ * in POSIX shared memory once by the coordinator (see Lattice::share) and workers map it read-only, so a node
+ * holds a single lattice copy regardless of the process count.
+ * Worker output lines are forwarded by the coordinator; results and energy traces are written to files of
+ * every shard and appended to the session files after the workers exit.
+ */
+namespace Shards {
+    typedef std::function<void(const std::string &)> LineWriter;
+
+    /**
+     * Get a shared memory object name that is unique on the node.
+     * @return Object name
+     */
+    inline std::string sharedName() {
+        static std::atomic<int> counter{0};
+        return "/MARS_CI_" + std::to_string(getpid()) + "_" + std::to_string(counter++);
+    }
+
+    constexpr int PATH_LENGTH = 256;
+    constexpr int GUARDED_SIGNALS[] = {SIGINT, SIGTERM, SIGHUP};
+
+    /**
+     * Get path of the shared memory object the signal handler removes, empty if there is none.
+     * @return Path buffer of PATH_LENGTH bytes
+     */
+    inline char *removalPath() {
+        static char path[PATH_LENGTH] = {};
+        return path;
+    }
+
+    /**
+     * Remove the guarded shared memory object and terminate the process by the same signal.
+     * Only async-signal-safe functions are called, the object is removed through its /dev/shm path.
+     * @param signal_number Signal number
+     */
+    inline void removeOnSignal(int signal_number) {
+        if (removalPath()[0] != '\0')
+            unlink(removalPath());
+        std::signal(signal_number, SIG_DFL);
+        raise(signal_number);
+    }
+
+    /**
+     * Removes a POSIX shared memory object when it goes out of scope, including by an exception, and when
+     * the process is terminated by SIGINT, SIGTERM or SIGHUP. A single object is guarded at a time.
+     */
+    class SharedObjectGuard {
+    private:
+        std::string name{};
+        void (*previous_handlers[sizeof(GUARDED_SIGNALS) / sizeof(int)])(int) = {};
+
+    public:
+        SharedObjectGuard() = default;
+
+        SharedObjectGuard(const SharedObjectGuard &) = delete;
+
+        SharedObjectGuard &operator=(const SharedObjectGuard &) = delete;
+
+        /**
+         * Start guarding an object. It may be created after the call, so that it is never left unguarded.
+         * @param object_name Shared memory object name
+         */
+        void reset(const std::string &object_name) {
+            release();
+            std::string path = "/dev/shm" + object_name;
+            if (path.size() >= PATH_LENGTH)
+                throw std::invalid_argument("Shared memory object name is too long: " + object_name);
+            name = object_name;
+            std::memcpy(removalPath(), path.c_str(), path.size() + 1);
+            for (unsigned int index = 0; index < sizeof(GUARDED_SIGNALS) / sizeof(int); ++index)
+                previous_handlers[index] = std::signal(GUARDED_SIGNALS[index], removeOnSignal);
+        }
+
+        /**
+         * Remove the guarded object, if any, and restore the previous signal handlers.
+         */
+        void release() {
+            if (name.empty())
+                return;
+            for (unsigned int index = 0; index < sizeof(GUARDED_SIGNALS) / sizeof(int); ++index)
+                std::signal(GUARDED_SIGNALS[index], previous_handlers[index]);
+            removalPath()[0] = '\0';
+            shm_unlink(name.c_str());
+            name.clear();
+        }
+
+        ~SharedObjectGuard() {
+            release();
+        }
+    };
+
+    /**
+     * Get name of a file written by a single shard instead of the session file.
+     * @param filename Session filename
+     * @param shard_index Shard index
+     * @return Shard filename
+     */
+    inline std::string shardFilename(const std::string &filename, int shard_index) {
+        return filename + ".shard" + std::to_string(shard_index);
+    }
+
+    /**
+     * Make options of a worker process.
+     * @param options Session options, including the parameters listed by Session::keys
+     * @param shard_index Shard index
+     * @param shard_count Shard count
+     * @param lattice_shared Shared memory object name of the lattice, empty if workers load it themselves
+     * @return Worker options
+     */
+    inline Options workerOptions(const Options &options, int shard_index, int shard_count,
+                                 const std::string &lattice_shared) {
+        Options worker = options;
+        worker.set("shard", std::to_string(shard_index) + "/" + std::to_string(shard_count));
+        if (not lattice_shared.empty())
+            worker.set("lattice_shm", lattice_shared);
+        for (const char *key : {"results", "energy_trace", "metrics"}) {
+            std::string filename = options.get(key);
+            if (not filename.empty() and filename != "NONE")
+                worker.set(key, shardFilename(filename, shard_index));
+        }
+        return worker;
+    }
+
+    /**
+     * Start a worker process with its standard output redirected to a pipe.
+     * @param options Worker options
+     * @param output_fd Read end of the output pipe
+     * @return Process ID, -1 on failure
+     */
+    inline pid_t spawn(const Options &options, int &output_fd) {
+        // Arguments are prepared before fork, the child only calls async-signal-safe functions
+        std::vector<std::string> arguments = options.arguments();
+        std::string executable = "/proc/self/exe";
+        std::vector<char *> argv{&executable[0]};
+        for (std::string &argument : arguments)
+            argv.push_back(&argument[0]);
+        argv.push_back(nullptr);
+
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+            return -1;
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            execv(executable.c_str(), argv.data());
+            _exit(127);
+        }
+        close(pipe_fds[1]);
+        if (pid < 0) {
+            close(pipe_fds[0]);
+            return -1;
+        }
+        output_fd = pipe_fds[0];
+        return pid;
+    }
+
+    /**
+     * Forward output lines of a worker until it closes its output.
+     * @param output_fd Read end of the output pipe, closed when the output ends
+     * @param write_line Function that outputs a line
+     */
+    inline void forwardOutput(int output_fd, const LineWriter &write_line) {
+        std::string pending;
+        char buffer[4096];
+        ssize_t length;
+        while ((length = read(output_fd, buffer, sizeof(buffer))) != 0) {
+            if (length < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            pending.append(buffer, (size_t) length);
+            std::string::size_type line_end;
+            while ((line_end = pending.find('\n')) != std::string::npos) {
+                write_line(pending.substr(0, line_end));
+                pending.erase(0, line_end + 1);
+            }
+        }
+        if (not pending.empty())
+            write_line(pending);
+        close(output_fd);
+    }
+
+    /**
+     * Append a shard file to the session file and remove it.
+     * @param writer Writer that owns the session file
+     * @param filename Session filename
+     * @param shard_index Shard index
+     */
+    inline void merge(AsyncWriter &writer, const std::string &filename, int shard_index) {
+        std::string shard_filename = shardFilename(filename, shard_index);
+        std::ifstream ifs(shard_filename, std::ios::binary);
+        if (not ifs.good())
+            return;
+        std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        ifs.close();
+        if (not data.empty())
+            writer.write(filename, data);
+        std::remove(shard_filename.c_str());
+    }
+
+    /**
+     * Run a session in worker processes and wait for them. The shared lattice object is left to the caller,
+     * which removes it with a SharedObjectGuard.
+     * @param writer Writer that owns the session files
+     * @param options Session options, including the parameters listed by Session::keys
+     * @param shard_count Quantity of worker processes
+     * @param lattice_shared Shared memory object name of the lattice, empty if workers load it themselves
+     * @param write_line Function that outputs a line
+     * @return Quantity of workers that failed
+     */
+    inline int run(AsyncWriter &writer, const Options &options, int shard_count, const std::string &lattice_shared,
+                   const LineWriter &write_line) {
+        std::vector<pid_t> pids(shard_count, -1);
+        std::vector<std::thread> readers;
+        for (int shard_index = 0; shard_index < shard_count; ++shard_index) {
+            int output_fd = -1;
+            pids[shard_index] = spawn(workerOptions(options, shard_index, shard_count, lattice_shared), output_fd);
+            if (pids[shard_index] > 0)
+                readers.emplace_back(forwardOutput, output_fd, std::cref(write_line));
+        }
+        for (std::thread &reader : readers)
+            reader.join();
+
+        int failed = 0;
+        for (int shard_index = 0; shard_index < shard_count; ++shard_index) {
+            int status = -1;
+            if (pids[shard_index] > 0)
+                while (waitpid(pids[shard_index], &status, 0) < 0 and errno == EINTR);
+            if (pids[shard_index] <= 0 or not WIFEXITED(status) or WEXITSTATUS(status) != 0) {
+                std::cerr << "Error: shard " << shard_index << " of " << shard_count << " failed" << std::endl;
+                failed++;
+            }
+        }
+
+        // Shard files are appended in shard order, failed shards keep the records they have written
+        for (int shard_index = 0; shard_index < shard_count; ++shard_index) {
+            std::string results = options.get("results"), energy_trace = options.get("energy_trace");
+            if (not results.empty() and results != "NONE")
+                merge(writer, results, shard_index);
+            if (not energy_trace.empty())
+                merge(writer, energy_trace, shard_index);
+        }
+        return failed;
+    }
+}
+
+#endif //MARS_CI_SHARDS_H
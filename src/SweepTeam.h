@@ -0,0 +1,245 @@
+#ifndef MARS_CI_SWEEPTEAM_H
+#define MARS_CI_SWEEPTEAM_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "AnnealingRun.h"
+#include "lib/Barrier.h"
+#include "lib/Lattice.h"
+#include "lib/Metrics.h"
+
+/**
+ * Sweep orders of a SweepTeam.
+ */
+enum SweepMode {
+    JACOBI,     // Every spin is updated from the local fields of the previous sweep
+    HYBRID      // Gauss-Seidel order inside a partition, Jacobi between partitions
+};
+
+/**
+ * Represents a team of threads that anneal a single run together.
+ * Spins of every set are split into contiguous partitions, one per thread. A thread computes new spin values
+ * of its partition and then adds the changes of the other partitions to the local fields of its partition,
+ * so every lattice row is streamed by all threads, each one reading its own column range.
+ *
+ * Convergence: JACOBI sweeps use the local fields of the previous sweep only, HYBRID sweeps also see the
+ * changes made earlier in the same partition. Both have the same fixed points as the sequential sweep and
+ * usually reach one in a similar quantity of sweeps, but they do not always settle: spins of different
+ * partitions that push each other may flip together back and forth, which is most likely with JACOBI sweeps
+ * at low temperatures. After FALLBACK_SWEEPS sweeps at a temperature level the team finishes the level with
+ * sequential Gauss-Seidel sweeps, which converge like AnnealingRun::annealingStep does.
+ * Link probabilities of a set are recalculated before every sweep of the set and stay fixed during it,
+ * while the sequential sweep updates them after every spin.
+ * @tparam T Spin and Lattice element value type
+ */
+template<typename T>
+class SweepTeam {
+private:
+    static constexpr double field_tolerance = 1e-5;
+    static constexpr int FALLBACK_SWEEPS = 64;
+
+    AnnealingRun<T> &run;
+    int team_size;
+    SweepMode mode;
+    Barrier barrier;
+
+    /**
+     * Local fields and spin values they were computed for, indexed by set index.
+     */
+    std::vector<std::vector<double>> local_fields{};
+    std::vector<std::vector<T>> field_values{};
+
+    /**
+     * Spin value changes made during the current set sweep, indexed by thread index.
+     */
+    std::vector<std::vector<std::pair<int, double>>> value_changes{};
+
+    /**
+     * Convergence flags of two consecutive sweeps, indexed by sweep parity and thread index.
+     */
+    std::vector<char> proceed_flags{};
+
+    /**
+     * Get spin index range of a partition.
+     * @param member Thread index
+     * @param partitions Partition quantity
+     * @return Index of the first spin and index after the last spin
+     */
+    std::pair<int, int> partition(int member, int partitions);
+
+    /**
+     * Perform a sweep over all spins of all sets. Called by all threads of the team.
+     * @tparam F Interaction formula policy (see Formula.h)
+     * @param member Thread index
+     * @param partitions Quantity of threads that update spins
+     * @param gauss_seidel True if changes are applied to the own partition immediately
+     * @param multiplier Interaction multiplier
+     * @param parity Sweep parity
+     * @return True if spins of any partition moved more than the threshold
+     */
+    template<typename F>
+    bool sweep(int member, int partitions, bool gauss_seidel, const BigFloat &multiplier, int parity);
+
+    /**
+     * Anneal the run together with the other threads.
+     * @param member Thread index
+     */
+    void work(int member);
+
+public:
+    /**
+     * SweepTeam constructor.
+     * @param run AnnealingRun object to anneal
+     * @param team_size Quantity of threads, including the calling one
+     * @param mode Sweep order
+     */
+    SweepTeam(AnnealingRun<T> &run, int team_size, SweepMode mode);
+
+    /**
+     * Perform a full annealing operation on the run.
+     */
+    void anneal();
+};
+
+template<typename T>
+SweepTeam<T>::SweepTeam(AnnealingRun<T> &run, int team_size, SweepMode mode) :
+        run(run), team_size(std::max(1, team_size)), mode(mode), barrier(this->team_size) {}
+
+template<typename T>
+std::pair<int, int> SweepTeam<T>::partition(int member, int partitions) {
+    if (member >= partitions)
+        return {0, 0};
+    long set_size = run.block.setSize();
+    return {(int) (set_size * member / partitions), (int) (set_size * (member + 1) / partitions)};
+}
+
+template<typename T>
+template<typename F>
+bool SweepTeam<T>::sweep(int member, int partitions, bool gauss_seidel, const BigFloat &multiplier, int parity) {
+    std::pair<int, int> range = partition(member, partitions);
+    const Lattice<T> &lattice = run.lattice;
+    bool proceed_iteration = false;
+    for (int set_index = 0; set_index < run.block.set_count; ++set_index) {
+        Set<T> &set = run[set_index];
+        // Spins are written bypassing the incremental probability update
+        if (member == 0)
+            for (int link_index = 0; link_index < set.linkedSets(); ++link_index)
+                set.recalculateProbabilities(link_index);
+        barrier.wait();
+
+        std::vector<double> &fields = local_fields[set_index];
+        std::vector<T> &values = field_values[set_index];
+        std::vector<std::pair<int, double>> &changes = value_changes[member];
+        changes.clear();
+        for (int spin_index = range.first; spin_index < range.second; ++spin_index) {
+            T target_value = run.spinValue(set.template meanField<F>(spin_index, fields[spin_index], multiplier));
+            if (fabs(target_value - set[spin_index]) > threshold)
+                proceed_iteration = true;
+            T new_spin_value = run.relaxedValue(set[spin_index], target_value);
+            set.writeSpin(spin_index, new_spin_value);
+
+            // Negligible changes stay pending until they accumulate
+            double value_change = new_spin_value - values[spin_index];
+            if (std::fabs(value_change) < field_tolerance)
+                continue;
+            values[spin_index] = new_spin_value;
+            changes.emplace_back(spin_index, value_change);
+            if (gauss_seidel) {
+                lattice.axpy(spin_index, value_change, fields.data(), range.first, range.second);
+                fields[spin_index] -= value_change * lattice(spin_index, spin_index);
+            }
+        }
+        barrier.wait();
+
+        // Every thread adds the changes of the sweep to the local fields of its partition
+        for (int other = 0; other < team_size; ++other) {
+            if (gauss_seidel and other == member)
+                continue;
+            for (const std::pair<int, double> &change : value_changes[other]) {
+                lattice.axpy(change.first, change.second, fields.data(), range.first, range.second);
+                if (change.first >= range.first and change.first < range.second)
+                    fields[change.first] -= change.second * lattice(change.first, change.first);
+            }
+        }
+    }
+
+    proceed_flags[parity * team_size + member] = proceed_iteration;
+    barrier.wait();
+    for (int other = 0; other < team_size; ++other)
+        proceed_iteration |= proceed_flags[parity * team_size + other] != 0;
+    return proceed_iteration;
+}
+
+template<typename T>
+void SweepTeam<T>::work(int member) {
+    std::pair<int, int> range = partition(member, team_size);
+    for (int set_index = 0; set_index < run.block.set_count; ++set_index)
+        for (int spin_index = range.first; spin_index < range.second; ++spin_index)
+            field_values[set_index][spin_index] = run[set_index][spin_index];
+    barrier.wait();
+    for (int set_index = 0; set_index < run.block.set_count; ++set_index) {
+        const T *values = field_values[set_index].data();
+        for (int spin_index = range.first; spin_index < range.second; ++spin_index)
+            local_fields[set_index][spin_index] = run.lattice.dot(spin_index, values) -
+                                                  (double) values[spin_index] * run.lattice(spin_index, spin_index);
+    }
+
+    int parity = 0, level_sweeps = 0;
+    while (true) {
+        // Temperature is only changed by the first thread while the others wait
+        barrier.wait();
+        if (run.temperature <= 0 or run.stopped)
+            return;
+        barrier.wait();
+        if (member == 0)
+            run.lowerTemperature(level_sweeps);
+        barrier.wait();
+
+        auto level_start = std::chrono::steady_clock::now();
+        BigFloat multiplier = run.currentMultiplier();
+        bool proceed_iteration = true;
+        for (level_sweeps = 0; proceed_iteration; ++level_sweeps) {
+            int partitions = level_sweeps < FALLBACK_SWEEPS ? team_size : 1;
+            bool gauss_seidel = mode == HYBRID or partitions == 1;
+            proceed_iteration = run.formula == FORMULA_ASYM ?
+                                sweep<AsymmetricFormula>(member, partitions, gauss_seidel, multiplier, parity) :
+                                sweep<SymmetricFormula>(member, partitions, gauss_seidel, multiplier, parity);
+            parity ^= 1;
+            if (member == 0)
+                run.step_counter++;
+        }
+        if (member != 0)
+            continue;
+        Metrics::annealingTime(Metrics::since(level_start));
+        Metrics::levelFinished(run.temperature, level_sweeps,
+                               (long) level_sweeps * run.block.set_count * run.block.setSize());
+        if (run.level_finished)
+            run.level_finished(run);
+    }
+}
+
+template<typename T>
+void SweepTeam<T>::anneal() {
+    int set_size = run.block.setSize();
+    // Spins are written bypassing the caches of the sets, the team keeps local fields of its own
+    for (int set_index = 0; set_index < run.block.set_count; ++set_index)
+        run.block[set_index].unbindLattice();
+    local_fields.assign(run.block.set_count, std::vector<double>(set_size, 0));
+    field_values.assign(run.block.set_count, std::vector<T>(set_size, 0));
+    value_changes.assign(team_size, {});
+    proceed_flags.assign(2 * team_size, 0);
+
+    std::vector<std::thread> threads;
+    for (int member = 1; member < team_size; ++member)
+        threads.emplace_back(&SweepTeam<T>::work, this, member);
+    work(0);
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+#endif //MARS_CI_SWEEPTEAM_H
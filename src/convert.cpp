@@ -0,0 +1,109 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "lib/Lattice.h"
+#include "lib/LatticeFile.h"
+#include "lib/ResultsFile.h"
+
+/*
+ * MARS_CI data conversion tool.
+ * Usage:
+ *   MARS_CI_convert lattice <text lattice> <binary lattice> [float|double|fp16|bf16|int8]
+ *       Convert a text lattice (dense matrix or edge list) to the binary format, default element type is float.
+ *       int8 elements are stored with a scale per row, the largest magnitude of a row maps to 127
+ *   MARS_CI_convert verify <binary lattice>
+ *       Print binary lattice header and check the data checksum
+ *   MARS_CI_convert results <binary results> <text results>
+ *       Convert a binary results file (MARS_CI results_format=binary) to the text results format
+ */
+
+void usage() {
+    std::cerr << "Usage:" << std::endl
+              << "  MARS_CI_convert lattice <text lattice> <binary lattice> [float|double|fp16|bf16|int8]" << std::endl
+              << "  MARS_CI_convert verify <binary lattice>" << std::endl
+              << "  MARS_CI_convert results <binary results> <text results>" << std::endl;
+}
+
+template<typename T, typename L = T>
+int convertLattice(const std::string &input_filename, const std::string &output_filename) {
+    // Reduced precision types are converted from a float lattice
+    Lattice<L> lattice = Lattice<L>(input_filename);
+    if (lattice.size() == 0) {
+        std::cerr << "Failed to load lattice from " << input_filename << std::endl;
+        return 1;
+    }
+    LatticeFile::write<T>(lattice, output_filename);
+    std::cout << "Wrote " << lattice.size() << "x" << lattice.size() << " lattice to " << output_filename
+              << std::endl;
+    return 0;
+}
+
+int verifyLattice(const std::string &filename) {
+    LatticeFile::Header header = LatticeFile::readHeader(filename);
+    uint64_t data_length = LatticeFile::dataLength(header);
+    std::cout << "Version: " << header.version << std::endl
+              << "Size: " << header.size << std::endl
+              << "Data type: " << LatticeFile::typeName(header.data_type) << std::endl
+              << "Symmetric: " << (header.flags & LatticeFile::SYMMETRIC ? "yes" : "no") << std::endl;
+
+    std::ifstream ifs(filename, std::ios::binary);
+    ifs.seekg((long) header.data_offset);
+    std::vector<char> buffer(1 << 20);
+    uint64_t checksum = LatticeFile::CHECKSUM_SEED, remaining = data_length;
+    while (remaining > 0 and ifs.good()) {
+        uint64_t chunk = std::min(remaining, (uint64_t) buffer.size());
+        ifs.read(buffer.data(), (long) chunk);
+        checksum = LatticeFile::checksum(checksum, buffer.data(), (uint64_t) ifs.gcount());
+        remaining -= (uint64_t) ifs.gcount();
+    }
+    bool valid = remaining == 0 and checksum == header.checksum;
+    std::cout << "Checksum: " << (valid ? "OK" : "MISMATCH") << std::endl;
+    return valid ? 0 : 1;
+}
+
+int convertResults(const std::string &input_filename, const std::string &output_filename) {
+    std::ifstream ifs(input_filename, std::ios::binary);
+    if (not ifs.good()) {
+        std::cerr << "Failed to open results file " << input_filename << std::endl;
+        return 1;
+    }
+    std::ofstream ofs(output_filename, std::ios::trunc);
+    ResultsFile::Record record{};
+    long record_count = 0;
+    while (ResultsFile::readBinary(ifs, record)) {
+        ofs << ResultsFile::toText(record);
+        record_count++;
+    }
+    std::cout << "Wrote " << record_count << " records to " << output_filename << std::endl;
+    return ofs.good() ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    try {
+        if (args.size() >= 3 and args[0] == "lattice") {
+            std::string data_type = args.size() > 3 ? args[3] : "float";
+            if (data_type == "float")
+                return convertLattice<float>(args[1], args[2]);
+            if (data_type == "double")
+                return convertLattice<double>(args[1], args[2]);
+            if (data_type == "fp16")
+                return convertLattice<Half, float>(args[1], args[2]);
+            if (data_type == "bf16")
+                return convertLattice<BFloat16, float>(args[1], args[2]);
+            if (data_type == "int8")
+                return convertLattice<int8_t, float>(args[1], args[2]);
+        } else if (args.size() == 2 and args[0] == "verify") {
+            return verifyLattice(args[1]);
+        } else if (args.size() == 3 and args[0] == "results") {
+            return convertResults(args[1], args[2]);
+        }
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    usage();
+    return 2;
+}
@@ -0,0 +1,277 @@
+#ifndef MARS_CI_ASYNCWRITER_H
+#define MARS_CI_ASYNCWRITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+#include "Metrics.h"
+
+/**
+ * Represents a writer that moves output I/O off the worker threads.
+ * Producers push data to a lock-free multi-producer single-consumer queue; a single writer thread
+ * appends it to the destination files through large buffers, which are flushed whenever the queue runs empty.
+ * Files are opened on first write and kept open until they are closed. Data of a single producer is written
+ * in the order it was pushed.
+ * Files can also be replaced as a whole, which is atomic with respect to crashes of the program.
+ */
+class AsyncWriter {
+private:
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+    enum Action {
+        APPEND,
+        REPLACE,
+        CLOSE
+    };
+
+    struct Node {
+        std::atomic<Node *> next{nullptr};
+        std::string filename, data;
+        Action action = APPEND;
+    };
+
+    // Producers append at head, the writer thread consumes from tail; tail always points to a consumed node
+    std::atomic<Node *> head;
+    Node *tail;
+
+    std::map<std::string, FILE *> files{};
+    std::thread writer;
+
+    // The writer thread sleeps only when the queue is empty, producers take the mutex only to wake it up
+    std::mutex sleep_mutex;
+    std::condition_variable data_available, queue_drained;
+    std::atomic<bool> sleeping{false}, stopping{false};
+    std::atomic<long> pending{0};
+
+    /**
+     * Take the next node from the queue.
+     * @param filename Destination filename
+     * @param data Data
+     * @param action Operation to perform on the file
+     * @return False if the queue is empty
+     */
+    bool pop(std::string &filename, std::string &data, Action &action);
+
+    /**
+     * Get destination file, open it if necessary.
+     * @param filename Destination filename, empty for standard output
+     * @return File pointer, nullptr if the file cannot be opened
+     */
+    FILE *file(const std::string &filename);
+
+    /**
+     * Replace file contents: write data to a temporary file, sync it and rename it over the file.
+     * Appended data pushed before is flushed first.
+     * @param filename Destination filename
+     * @param data Data
+     */
+    void replaceFile(const std::string &filename, const std::string &data);
+
+    /**
+     * Flush and close destination file if it is open.
+     * @param filename Destination filename
+     */
+    void closeFile(const std::string &filename);
+
+    /**
+     * Push a node to the queue and wake the writer thread up.
+     * @param node Queue node
+     */
+    void push(Node *node);
+
+    void writerLoop();
+
+public:
+    AsyncWriter();
+
+    AsyncWriter(const AsyncWriter &) = delete;
+
+    AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+    /**
+     * AsyncWriter destructor. Writes all pushed data before returning.
+     */
+    ~AsyncWriter();
+
+    /**
+     * Append data to a file.
+     * @param filename Destination filename, empty for standard output
+     * @param data Data
+     */
+    void write(const std::string &filename, std::string data);
+
+    /**
+     * Replace file contents. Readers see either the old or the new contents of the file, never a part of them.
+     * @param filename Destination filename
+     * @param data Data
+     */
+    void replace(const std::string &filename, std::string data);
+
+    /**
+     * Close a file after all data pushed to it before is written. A later write opens it again.
+     * @param filename Destination filename
+     */
+    void close(const std::string &filename);
+
+    /**
+     * Wait until all data pushed before the call is written and flushed.
+     */
+    void flush();
+};
+
+AsyncWriter::AsyncWriter() : head(new Node), tail(head.load()) {
+    writer = std::thread(&AsyncWriter::writerLoop, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    flush();
+    stopping = true;
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        data_available.notify_all();
+    }
+    writer.join();
+    for (auto &entry : files)
+        if (entry.second != nullptr and entry.second != stdout)
+            fclose(entry.second);
+    delete tail;
+}
+
+void AsyncWriter::write(const std::string &filename, std::string data) {
+    Node *node = new Node;
+    node->filename = filename;
+    node->data = std::move(data);
+    push(node);
+}
+
+void AsyncWriter::replace(const std::string &filename, std::string data) {
+    Node *node = new Node;
+    node->filename = filename;
+    node->data = std::move(data);
+    node->action = REPLACE;
+    push(node);
+}
+
+void AsyncWriter::close(const std::string &filename) {
+    Node *node = new Node;
+    node->filename = filename;
+    node->action = CLOSE;
+    push(node);
+}
+
+void AsyncWriter::push(AsyncWriter::Node *node) {
+    pending++;
+    Node *previous = head.exchange(node, std::memory_order_acq_rel);
+    // Sequentially consistent store pairs with the sleep announcement of the writer thread
+    previous->next.store(node);
+    if (sleeping.load()) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        data_available.notify_one();
+    }
+}
+
+bool AsyncWriter::pop(std::string &filename, std::string &data, Action &action) {
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr)
+        return false;
+    filename = std::move(next->filename);
+    data = std::move(next->data);
+    action = next->action;
+    delete tail;
+    tail = next;
+    return true;
+}
+
+FILE *AsyncWriter::file(const std::string &filename) {
+    auto entry = files.find(filename);
+    if (entry != files.end())
+        return entry->second;
+    FILE *file_pointer = filename.empty() ? stdout : fopen(filename.c_str(), "ab");
+    if (file_pointer != nullptr and file_pointer != stdout)
+        setvbuf(file_pointer, nullptr, _IOFBF, BUFFER_SIZE);
+    return files[filename] = file_pointer;
+}
+
+void AsyncWriter::replaceFile(const std::string &filename, const std::string &data) {
+    for (auto &entry : files)
+        if (entry.second != nullptr)
+            fflush(entry.second);
+    std::string temporary_filename = filename + ".tmp";
+    FILE *file_pointer = fopen(temporary_filename.c_str(), "wb");
+    if (file_pointer == nullptr)
+        return;
+    bool written = fwrite(data.data(), 1, data.size(), file_pointer) == data.size() and fflush(file_pointer) == 0 and
+                   fsync(fileno(file_pointer)) == 0;
+    if (fclose(file_pointer) == 0 and written)
+        std::rename(temporary_filename.c_str(), filename.c_str());
+    else
+        std::remove(temporary_filename.c_str());
+}
+
+void AsyncWriter::closeFile(const std::string &filename) {
+    auto entry = files.find(filename);
+    if (entry == files.end())
+        return;
+    if (entry->second != nullptr and entry->second != stdout)
+        fclose(entry->second);
+    files.erase(entry);
+}
+
+void AsyncWriter::writerLoop() {
+    std::string filename, data;
+    Action action = APPEND;
+    while (true) {
+        long written = 0;
+        auto write_start = std::chrono::steady_clock::now();
+        long bytes = 0;
+        while (pop(filename, data, action)) {
+            written++;
+            bytes += (long) data.size();
+            if (action == REPLACE) {
+                replaceFile(filename, data);
+                continue;
+            }
+            if (action == CLOSE) {
+                closeFile(filename);
+                continue;
+            }
+            FILE *file_pointer = file(filename);
+            if (file_pointer != nullptr)
+                fwrite(data.data(), 1, data.size(), file_pointer);
+        }
+        if (written > 0) {
+            for (auto &entry : files)
+                if (entry.second != nullptr)
+                    fflush(entry.second);
+            Metrics::written(bytes, Metrics::since(write_start));
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            pending -= written;
+            queue_drained.notify_all();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping = true;
+        // Recheck after announcing the sleep, a producer may have pushed in between
+        data_available.wait(lock, [this] {
+            return stopping or tail->next.load() != nullptr;
+        });
+        sleeping = false;
+        if (stopping and tail->next.load(std::memory_order_acquire) == nullptr)
+            return;
+    }
+}
+
+void AsyncWriter::flush() {
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    queue_drained.wait(lock, [this] { return pending == 0; });
+}
+
+#endif //MARS_CI_ASYNCWRITER_H
@@ -0,0 +1,50 @@
+#ifndef MARS_CI_BARRIER_H
+#define MARS_CI_BARRIER_H
+
+#include <atomic>
+#include <thread>
+
+/**
+ * Represents a reusable barrier for a fixed team of threads.
+ * The last arriving thread flips the barrier phase; the others spin on it for a while and then yield,
+ * so short waits do not enter the kernel and long ones do not starve other threads of the core.
+ */
+class Barrier {
+private:
+    static constexpr int SPIN_COUNT = 1 << 12;
+
+    const int thread_count;
+    std::atomic<int> arrived{0};
+    std::atomic<unsigned> phase{0};
+
+public:
+    /**
+     * Barrier constructor.
+     * @param thread_count Quantity of threads that wait on the barrier
+     */
+    explicit Barrier(int thread_count) : thread_count(thread_count) {}
+
+    Barrier(const Barrier &) = delete;
+
+    Barrier &operator=(const Barrier &) = delete;
+
+    /**
+     * Block until all threads of the team call this method.
+     * Memory writes made before the call are visible to all threads after it.
+     */
+    void wait();
+};
+
+void Barrier::wait() {
+    unsigned current_phase = phase.load(std::memory_order_acquire);
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) == thread_count - 1) {
+        arrived.store(0, std::memory_order_relaxed);
+        phase.store(current_phase + 1, std::memory_order_release);
+        return;
+    }
+    for (int spin = 0; phase.load(std::memory_order_acquire) == current_phase; ++spin)
+        if (spin >= SPIN_COUNT)
+            std::this_thread::yield();
+}
+
+#endif //MARS_CI_BARRIER_H
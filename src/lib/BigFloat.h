@@ -5,158 +5,193 @@
 #ifndef MARS_CI_BIGFLOAT_H
 #define MARS_CI_BIGFLOAT_H
 
+#include <algorithm>
 #include <cfloat>
+#include <climits>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <sstream>
 
 /**
  * Represents a floating-point variable with upper bound about 1e1000000000.
+ * The value is stored as mantissa * 2^exponent with 0.5 <= |mantissa| < 1, zero has zero mantissa and exponent.
+ * Products and quotients are normalized with a single conditional step, sums with one frexp call.
+ * The log-domain interface (fromLog, log) converts to and from natural logarithms without overflow.
  */
 class BigFloat {
 private:
+    static constexpr double LN_2 = 0.693147180559945309417;
+    static constexpr double LOG2_10 = 3.32192809488736234787;
+    static constexpr double LOG10_2 = 0.301029995663981195214;
+
     double mantissa;
     long exponent;
 
-    void setupPrecision();
-
-    BigFloat add(BigFloat _bigFloat);
+    struct Raw {
+    };
 
-    BigFloat multiplyBy(BigFloat _bigFloat);
+    /**
+     * Construct from already normalized mantissa and exponent.
+     */
+    constexpr BigFloat(double _mantissa, long _exponent, Raw) : mantissa(_mantissa), exponent(_exponent) {}
 
-    BigFloat oneDivideByThis();
+    /**
+     * Normalize a product of two normalized mantissas, 0.25 <= |m| < 1.
+     */
+    static constexpr BigFloat normalizedProduct(double m, long e) {
+        bool shift = m < 0.5 and m > -0.5 and m != 0;
+        return m == 0 ? BigFloat(0., 0, Raw{}) : BigFloat(shift ? m * 2 : m, shift ? e - 1 : e, Raw{});
+    }
 
-    bool equals(BigFloat _bigFloat);
+    /**
+     * Normalize a quotient of two normalized mantissas, 0.5 < |m| < 2. Infinite quotients keep zero exponent.
+     */
+    static constexpr BigFloat normalizedQuotient(double m, long e) {
+        bool shift = m >= 1 or m <= -1;
+        return m - m != 0 ? BigFloat(m, 0, Raw{}) :
+               m == 0 ? BigFloat(0., 0, Raw{}) : BigFloat(shift ? m / 2 : m, shift ? e + 1 : e, Raw{});
+    }
 
-    bool moreThan(BigFloat _bigFloat);
+    /**
+     * Normalize an arbitrary mantissa. Normal doubles are split by their exponent bits directly.
+     */
+    static BigFloat normalized(double m, long e) {
+        uint64_t bits;
+        std::memcpy(&bits, &m, sizeof(bits));
+        long biased_exp = (long) ((bits >> 52) & 0x7FF);
+        if (biased_exp == 0 or biased_exp == 0x7FF) {
+            // Zero, subnormal or non-finite value
+            if (m == 0 or not std::isfinite(m))
+                return BigFloat(m, 0, Raw{});
+            int shift = 0;
+            m = std::frexp(m, &shift);
+            return BigFloat(m, e + shift, Raw{});
+        }
+        bits = (bits & ~((uint64_t) 0x7FF << 52)) | ((uint64_t) 1022 << 52);
+        std::memcpy(&m, &bits, sizeof(m));
+        return BigFloat(m, e + biased_exp - 1022, Raw{});
+    }
 
-    BigFloat getCopy();
+    /**
+     * Get 2^-shift for 0 <= shift <= 64.
+     */
+    static double inversePowerOfTwo(long shift) {
+        uint64_t bits = (uint64_t) (1023 - shift) << 52;
+        double result;
+        std::memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
 
 public:
-    BigFloat(double _base, double _exp = 0) {
-        if (_base == 0) {
-            mantissa = _base;
-            exponent = 0;
+    /**
+     * BigFloat constructor.
+     * @param _base Base value
+     * @param _exp Decimal exponent, the value is _base * 10^_exp
+     */
+    BigFloat(double _base, double _exp = 0) : mantissa(0), exponent(0) {
+        if (_base == 0)
+            return;
+        if (_exp == 0) {
+            *this = normalized(_base, 0);
             return;
         }
-        mantissa = _base * exp10(_exp - (double) (long) _exp);
-        exponent = (long) _exp;
-        setupPrecision();
+        double binary_exp = _exp * LOG2_10;
+        double whole = std::floor(binary_exp);
+        *this = normalized(_base * std::exp2(binary_exp - whole), (long) whole);
     }
 
-    double log() { return (double) exponent + std::log(mantissa); }
+    /**
+     * Create a BigFloat from its natural logarithm.
+     * @param _log Natural logarithm of the value
+     * @return BigFloat equal to e^_log
+     */
+    static BigFloat fromLog(double _log) {
+        double binary_exp = _log / LN_2;
+        double whole = std::floor(binary_exp);
+        return normalized(std::exp2(binary_exp - whole), (long) whole);
+    }
 
-    explicit operator float() {
-        this->setupPrecision();
-        if (exponent >= 38)  // Prevent overflow
+    /**
+     * Get natural logarithm of the value.
+     * @return Natural logarithm
+     */
+    double log() const { return (double) exponent * LN_2 + std::log(mantissa); }
+
+    explicit operator float() const {
+        if (exponent > FLT_MAX_EXP)  // Prevent overflow
             return FLT_MAX * (float) (mantissa > 0 ? 1 : -1);
-        return (float) mantissa * exp10f((float) exponent);
+        return (float) std::ldexp(mantissa, (int) std::max(exponent, (long) INT_MIN));
     }
 
-    explicit operator double() {
-        this->setupPrecision();
-        if (exponent >= 308)  // Prevent overflow
+    explicit operator double() const {
+        if (exponent > DBL_MAX_EXP)  // Prevent overflow
             return DBL_MAX * (double) (mantissa > 0 ? 1 : -1);
-        return mantissa * exp10((double) exponent);
+        return std::ldexp(mantissa, (int) std::max(exponent, (long) INT_MIN));
     }
 
-    explicit operator std::string() {
+    explicit operator std::string() const {
         std::ostringstream oss;
-        oss << mantissa << "e" << exponent;
+        if (mantissa == 0 or not std::isfinite(mantissa)) {
+            oss << mantissa;
+            return oss.str();
+        }
+        double decimal_exp = (double) exponent * LOG10_2 + std::log10(std::fabs(mantissa));
+        double whole = std::floor(decimal_exp);
+        oss << (mantissa > 0 ? 1 : -1) * std::pow(10., decimal_exp - whole) << "e" << (long) whole;
         return oss.str();
     }
 
-    BigFloat &operator=(float _float) {
-        *this = BigFloat(_float);
-        return *this;
+    constexpr bool operator==(const BigFloat &_bigFloat) const {
+        return _bigFloat.mantissa == mantissa and _bigFloat.exponent == exponent;
     }
 
-    bool operator==(BigFloat _bigFloat) { return this->equals(_bigFloat); }
+    constexpr bool operator!=(const BigFloat &_bigFloat) const { return not(*this == _bigFloat); }
 
-    bool operator!=(BigFloat _bigFloat) { return not(*this == _bigFloat); }
+    constexpr bool operator>(const BigFloat &_bigFloat) const {
+        return mantissa * _bigFloat.mantissa <= 0 ? mantissa > _bigFloat.mantissa :
+               exponent == _bigFloat.exponent ? mantissa > _bigFloat.mantissa :
+               (exponent > _bigFloat.exponent) == (mantissa > 0);
+    }
 
-    BigFloat operator+(BigFloat _bigFloat) { return this->getCopy().add(_bigFloat); }
+    constexpr bool operator<(const BigFloat &_bigFloat) const { return _bigFloat > *this; }
 
-    BigFloat operator*(BigFloat _bigFloat) { return this->getCopy().multiplyBy(_bigFloat); }
+    constexpr BigFloat operator-() const { return BigFloat(-mantissa, exponent, Raw{}); }
 
-    BigFloat operator/(BigFloat _bigFloat) {
-        return this->getCopy().multiplyBy(_bigFloat.getCopy().oneDivideByThis());
+    constexpr BigFloat operator*(const BigFloat &_bigFloat) const {
+        return normalizedProduct(mantissa * _bigFloat.mantissa, exponent + _bigFloat.exponent);
     }
 
-    void operator+=(BigFloat _bigFloat) { this->add(_bigFloat); }
+    constexpr BigFloat operator/(const BigFloat &_bigFloat) const {
+        return normalizedQuotient(mantissa / _bigFloat.mantissa, exponent - _bigFloat.exponent);
+    }
 
-    void operator-=(BigFloat _bigFloat) { this->add(_bigFloat * -1); }
+    BigFloat operator+(const BigFloat &_bigFloat) const {
+        if (_bigFloat.mantissa == 0)
+            return *this;
+        if (mantissa == 0)
+            return _bigFloat;
+        // Operands more than 64 binary orders apart do not affect each other
+        long exp_diff = exponent - _bigFloat.exponent;
+        if (exp_diff > 64)
+            return *this;
+        if (exp_diff < -64)
+            return _bigFloat;
+        if (exp_diff >= 0)
+            return normalized(mantissa + _bigFloat.mantissa * inversePowerOfTwo(exp_diff), exponent);
+        return normalized(mantissa * inversePowerOfTwo(-exp_diff) + _bigFloat.mantissa, _bigFloat.exponent);
+    }
 
-    void operator*=(BigFloat _bigFloat) { this->multiplyBy(_bigFloat); }
+    BigFloat operator-(const BigFloat &_bigFloat) const { return *this + -_bigFloat; }
 
-    bool operator>(BigFloat _bigFloat) { return this->moreThan(_bigFloat); }
+    BigFloat &operator+=(const BigFloat &_bigFloat) { return *this = *this + _bigFloat; }
 
-    bool operator<(BigFloat _bigFloat) { return not(*this == _bigFloat) and not(*this > _bigFloat); }
-};
+    BigFloat &operator-=(const BigFloat &_bigFloat) { return *this = *this - _bigFloat; }
 
-void BigFloat::setupPrecision() {
-    if (mantissa == 0 or std::isinf(mantissa)) {
-        exponent = 0;
-        return;
-    }
-    while (std::fabs(mantissa) > 10) {
-        mantissa /= 10;
-        exponent += 1;
-    }
-    while (std::fabs(mantissa) < 1) {
-        mantissa *= 10;
-        exponent -= 1;
-    }
-}
-
-BigFloat BigFloat::add(BigFloat _bigFloat) {
-    if (_bigFloat.mantissa == 0)
-        return *this;
-    if (mantissa == 0) {
-        mantissa = _bigFloat.mantissa;
-        exponent = _bigFloat.exponent;
-        return *this;
-    }
+    BigFloat &operator*=(const BigFloat &_bigFloat) { return *this = *this * _bigFloat; }
 
-    if (exponent < _bigFloat.exponent) {
-        long expDiff = _bigFloat.exponent - exponent;
-        mantissa /= exp10f((float) expDiff);
-        exponent += expDiff;
-    }
-    mantissa += _bigFloat.mantissa * exp10f((float) (_bigFloat.exponent - exponent));
-    setupPrecision();
-    return *this;
-}
-
-BigFloat BigFloat::multiplyBy(BigFloat _bigFloat) {
-    mantissa *= _bigFloat.mantissa;
-    exponent += _bigFloat.exponent;
-    setupPrecision();
-    return *this;
-}
-
-BigFloat BigFloat::oneDivideByThis() {
-    mantissa = 1. / mantissa;
-    exponent *= -1;
-    setupPrecision();
-    return *this;
-}
-
-bool BigFloat::equals(BigFloat _bigFloat) {
-    return _bigFloat.mantissa == mantissa and _bigFloat.exponent == exponent;
-}
-
-bool BigFloat::moreThan(BigFloat _bigFloat) {
-    return mantissa * _bigFloat.mantissa <= 0 ? mantissa > _bigFloat.mantissa :
-           exponent > _bigFloat.exponent ? true :
-           _bigFloat.exponent > exponent ? false : mantissa > _bigFloat.mantissa;
-}
-
-BigFloat BigFloat::getCopy() {
-    BigFloat bf{0};
-    bf.mantissa = mantissa;
-    bf.exponent = exponent;
-    return bf;
-}
+    BigFloat &operator/=(const BigFloat &_bigFloat) { return *this = *this / _bigFloat; }
+};
 
 #endif  //MARS_CI_BIGFLOAT_H
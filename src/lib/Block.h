@@ -5,7 +5,11 @@
 #ifndef MARS_CI_BLOCK_H
 #define MARS_CI_BLOCK_H
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <memory>
+#include <new>
 #include <string>
 #include <vector>
 
@@ -16,6 +20,10 @@
 /**
  * Represents a union of several spin sets that interact with each other.
  * Set interaction is described by the links field.
+ * Spin values of all sets are stored in a single arena owned by the block, every set starts on a cache line.
+ * The arena also holds a spin-major mirror of the values, where spin i of every set is adjacent, so that
+ * interaction terms read the values of a spin in all linked sets from one place.
+ * Sets refer to each other by index, so a block may be moved but not copied.
  * @tparam T Spin value type
  */
 template<typename T>
@@ -25,8 +33,21 @@ class Block {
      * The links object contains a SetLink for every set in block.
      */
     typedef std::vector<int> SetLink;
+
+    /**
+     * Frees arena memory allocated with posix_memalign.
+     */
+    struct ArenaDeleter {
+        void operator()(T *arena) const { free(arena); }
+    };
+
 private:
-    Set<T> *sets = nullptr;
+    static constexpr int CACHE_LINE = 64;
+
+    std::unique_ptr<T, ArenaDeleter> arena{};
+    std::vector<Set<T>> sets{};
+    int set_stride = 0;
+    T *spin_columns = nullptr;
 
 public:
     int set_count = 0;
@@ -37,13 +58,21 @@ public:
     Block() = default;
 
     /**
-     * Block constructor.
-     * @param set_size Quantity of spins in sets
+     * Block constructor. Allocates the spin value arena, spin values are not initialized.
+     * Spin values written with setValues must be mirrored with syncColumns before the sets are used.
      * @param set_count Quantity of sets in block
-     * @param block_values Spin values array pointer
-     * @param links Link array pointer
+     * @param set_size Quantity of spins in sets
+     * @param links Links of every set
      */
-    Block(int set_count, Set<T> *sets, SetLink *links);
+    Block(int set_count, int set_size, const std::vector<SetLink> &links);
+
+    Block(const Block &) = delete;
+
+    Block &operator=(const Block &) = delete;
+
+    Block(Block &&) noexcept = default;
+
+    Block &operator=(Block &&) noexcept = default;
 
     /**
      * Get Set from specified index.
@@ -52,6 +81,18 @@ public:
      */
     Set<T> &operator[](int index);
 
+    /**
+     * Get spin value array of specified set in the arena.
+     * @param set_index Index of set in block
+     * @return Spin value array pointer
+     */
+    T *setValues(int set_index);
+
+    /**
+     * Copy spin values of all sets to the spin-major mirror.
+     */
+    void syncColumns();
+
     /**
      * Set spin value of specified spin and perform additional actions if needed.
      * @param set_index Index of set in block
@@ -68,9 +109,21 @@ public:
 };
 
 template<typename T>
-Block<T>::Block(int set_count, Set<T> *sets, Block::SetLink *links) :
-        sets(sets), set_count(set_count) {
-    for (int set_index = 0; set_index < this->set_count; ++set_index) {
+Block<T>::Block(int set_count, int set_size, const std::vector<SetLink> &links) : set_count(set_count) {
+    // Sets are padded to whole cache lines, so that every set starts on one
+    int line_values = CACHE_LINE / (int) sizeof(T);
+    set_stride = (set_size + line_values - 1) / line_values * line_values;
+    // The mirror follows the sets, so it starts on a cache line too
+    size_t arena_length = (size_t) set_stride * set_count + (size_t) set_size * set_count;
+    void *memory = nullptr;
+    if (posix_memalign(&memory, CACHE_LINE, std::max<size_t>(1, arena_length * sizeof(T))) != 0)
+        throw std::bad_alloc();
+    arena.reset(static_cast<T *>(memory));
+    spin_columns = arena.get() + (long) set_stride * set_count;
+
+    // Sets keep a pointer to the set array, so it must not be reallocated after they are created
+    sets.reserve(set_count);
+    for (int set_index = 0; set_index < set_count; ++set_index) {
         SetType set_type;
         if (links[set_index].empty())
             set_type = INDEPENDENT;
@@ -78,11 +131,12 @@ Block<T>::Block(int set_count, Set<T> *sets, Block::SetLink *links) :
             set_type = NO_ANNEAL;
         else
             set_type = DEPENDENT;
-        sets[set_index].set_type = set_type;
-        for (int link_index : links[set_index]) {
-            sets[set_index].createLink(sets[link_index]);
-        }
+        sets.emplace_back(set_size, setValues(set_index), set_type, sets.data(), set_index, spin_columns, set_count);
     }
+    for (int set_index = 0; set_index < set_count; ++set_index)
+        for (int link_index : links[set_index])
+            if (link_index >= 0)
+                sets[set_index].createLink(link_index);
 }
 
 template<typename T>
@@ -90,6 +144,20 @@ Set<T> &Block<T>::operator[](int index) {
     return sets[index];
 }
 
+template<typename T>
+T *Block<T>::setValues(int set_index) {
+    return arena.get() + (long) set_index * set_stride;
+}
+
+template<typename T>
+void Block<T>::syncColumns() {
+    for (int set_index = 0; set_index < set_count; ++set_index) {
+        const T *values = setValues(set_index);
+        for (int spin_index = 0; spin_index < setSize(); ++spin_index)
+            spin_columns[(long) spin_index * set_count + set_index] = values[spin_index];
+    }
+}
+
 template<typename T>
 void Block<T>::setSpin(int set_index, int spin_index, T spin_value) {
     sets[set_index].setSpin(spin_index, spin_value);
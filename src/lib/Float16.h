@@ -0,0 +1,100 @@
+#ifndef MARS_CI_FLOAT16_H
+#define MARS_CI_FLOAT16_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Represents an IEEE 754 half precision value (1 sign, 5 exponent and 10 mantissa bits).
+ * Used as a lattice storage type only, arithmetic is done after conversion to float.
+ */
+struct Half {
+    uint16_t bits;
+
+    Half() = default;
+
+    /**
+     * Half constructor. Rounds to the nearest representable value, values above 65504 become infinite.
+     * @param value Float value
+     */
+    explicit Half(float value);
+
+    /**
+     * Convert to float, exact.
+     */
+    operator float() const;
+};
+
+/**
+ * Represents a bfloat16 value: the upper half of a float, with the float exponent range and 7 mantissa bits.
+ * Used as a lattice storage type only, arithmetic is done after conversion to float.
+ */
+struct BFloat16 {
+    uint16_t bits;
+
+    BFloat16() = default;
+
+    /**
+     * BFloat16 constructor. Rounds to the nearest representable value.
+     * @param value Float value
+     */
+    explicit BFloat16(float value);
+
+    /**
+     * Convert to float, exact.
+     */
+    operator float() const;
+};
+
+inline Half::Half(float value) {
+    uint32_t x = 0;
+    std::memcpy(&x, &value, sizeof(x));
+    auto sign = (uint16_t) ((x >> 16) & 0x8000);
+    uint32_t magnitude = x & 0x7FFFFFFF;
+    if (magnitude > 0x7F800000) {
+        bits = sign | 0x7E00;
+    } else if (magnitude >= 0x477FF000) {
+        // 65520 and above round to infinity
+        bits = sign | 0x7C00;
+    } else if (magnitude < 0x38800000) {
+        // Subnormal: scaling by 2^24 is exact, the mantissa is the rounded result
+        float subnormal = 0;
+        std::memcpy(&subnormal, &magnitude, sizeof(subnormal));
+        bits = sign | (uint16_t) std::nearbyint(subnormal * 16777216.f);
+    } else {
+        // Rebias the exponent and round to nearest even, the carry may propagate into the exponent
+        magnitude += 0xC8000FFF + ((magnitude >> 13) & 1);
+        bits = sign | (uint16_t) (magnitude >> 13);
+    }
+}
+
+inline Half::operator float() const {
+    uint32_t sign = (uint32_t) (bits & 0x8000) << 16, exponent = (bits >> 10) & 0x1F, mantissa = bits & 0x3FF;
+    if (exponent == 0) {
+        auto value = (float) mantissa / 16777216.f;
+        return sign != 0 ? -value : value;
+    }
+    uint32_t x = sign | (exponent == 0x1F ? 0x7F800000 : (exponent + 112) << 23) | (mantissa << 13);
+    float value = 0;
+    std::memcpy(&value, &x, sizeof(value));
+    return value;
+}
+
+inline BFloat16::BFloat16(float value) {
+    uint32_t x = 0;
+    std::memcpy(&x, &value, sizeof(x));
+    if ((x & 0x7FFFFFFF) > 0x7F800000)
+        bits = (uint16_t) ((x >> 16) | 0x40);
+    else
+        bits = (uint16_t) ((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
+}
+
+inline BFloat16::operator float() const {
+    uint32_t x = (uint32_t) bits << 16;
+    float value = 0;
+    std::memcpy(&value, &x, sizeof(value));
+    return value;
+}
+
+#endif //MARS_CI_FLOAT16_H
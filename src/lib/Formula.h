@@ -0,0 +1,54 @@
+#ifndef MARS_CI_FORMULA_H
+#define MARS_CI_FORMULA_H
+
+#include "BigFloat.h"
+
+/**
+ * Interaction formulas that give the mean field term a link adds to a spin.
+ */
+enum FormulaType {
+    FORMULA_SYM,    // Depends on the linked spin, the own spin and the link equality probabilities
+    FORMULA_ASYM    // Depends on the linked spin only
+};
+
+/**
+ * Symmetric interaction formula policy.
+ * The link term is 0.5 * log of the ratio of equality probabilities of the link with the spin up and down.
+ */
+struct SymmetricFormula {
+    static constexpr bool uses_probabilities = true;
+
+    /**
+     * Get logarithm of the link term ratio.
+     * @param linked_value Linked set spin value, must not be +-1
+     * @param spin_value Own spin value
+     * @param probability Equality probability product of the link
+     * @param inv_probability Inverse equality probability product of the link
+     * @return Natural logarithm, the term is 0.5 * interaction multiplier times it
+     */
+    template<typename T>
+    static double logRatio(T linked_value, T spin_value, const BigFloat &probability,
+                           const BigFloat &inv_probability) {
+        constexpr T delta = 0.01;
+        // Spin factors the products hold for the current spin value are divided out
+        BigFloat linked_up{1 + linked_value}, linked_down{1 - linked_value};
+        BigFloat same{1 + linked_value * spin_value}, opposite{1 - linked_value * spin_value};
+        return ((probability * linked_up / same + inv_probability * linked_down / opposite + delta) /
+                (probability * linked_down / same + inv_probability * linked_up / opposite + delta)).log();
+    }
+};
+
+/**
+ * Asymmetric interaction formula policy.
+ * The link term is 0.5 * log((1 + s) / (1 - s)) of the linked spin s, so the spin follows the linked one.
+ */
+struct AsymmetricFormula {
+    static constexpr bool uses_probabilities = false;
+
+    template<typename T>
+    static double logRatio(T linked_value, T, const BigFloat &, const BigFloat &) {
+        return BigFloat{(1 + linked_value) / (1 - linked_value)}.log();
+    }
+};
+
+#endif //MARS_CI_FORMULA_H
@@ -0,0 +1,555 @@
+#ifndef MARS_CI_KERNELS_H
+#define MARS_CI_KERNELS_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "Float16.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MARS_CI_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/**
+ * This namespace contains vector kernels used in lattice row operations.
+ * The implementation is chosen once at startup from the CPU features;
+ * the MARS_CI_KERNELS environment variable (portable, avx2, avx512) can restrict the choice.
+ * Rows may be stored in reduced precision (Half, BFloat16 or int8_t); their elements are converted to float
+ * while they are loaded, so the products are taken in float precision like those of float rows.
+ */
+namespace Kernels {
+    /**
+     * Value type that reduced precision row elements are converted to.
+     * @tparam E Row element storage type
+     */
+    template<typename E>
+    struct Widened {
+        typedef E type;
+    };
+
+    template<>
+    struct Widened<Half> {
+        typedef float type;
+    };
+
+    template<>
+    struct Widened<BFloat16> {
+        typedef float type;
+    };
+
+    template<>
+    struct Widened<int8_t> {
+        typedef float type;
+    };
+
+    /**
+     * Set of kernel implementations for a single row element type.
+     * @tparam E Row element storage type
+     * @tparam T Value type of the vectors rows are multiplied by
+     */
+    template<typename E, typename T = typename Widened<E>::type>
+    struct KernelSet {
+        const char *name;
+
+        /**
+         * Calculate sum of a[i] * b[i]. Products are taken in T precision and summed up in double.
+         */
+        double (*dot)(const E *a, const T *b, long n);
+
+        /**
+         * Add multiplier * x[i] to y[i].
+         */
+        void (*axpy)(double multiplier, const E *x, double *y, long n);
+
+        /**
+         * Add sum of multipliers[t * count + r] * x[t][i] over t < rows to y[r * n + i] for every r < count.
+         * This is a rank-rows update of the replica-major n x count value matrix: row elements are read once
+         * for all replicas and values are written once per tile of rows.
+         */
+        void (*axpyReplicas)(const double *multipliers, const E *const *x, int rows, double *y, int count, long n);
+    };
+
+    /**
+     * Quantity of row elements converted to double at a time by replica updates.
+     */
+    constexpr long REPLICA_CHUNK = 256;
+
+    /**
+     * Convert elements [begin, begin + length) of rows to double.
+     */
+    template<typename E>
+    inline void widenRows(const E *const *x, int rows, long begin, long length, double (*row_values)[REPLICA_CHUNK]) {
+        for (int t = 0; t < rows; ++t)
+            for (long i = 0; i < length; ++i)
+                row_values[t][i] = (typename Widened<E>::type) x[t][begin + i];
+    }
+
+    namespace Portable {
+        template<typename E, typename T>
+        double dot(const E *a, const T *b, long n) {
+            double sum = 0;
+            for (long i = 0; i < n; ++i)
+                sum += (typename Widened<E>::type) a[i] * b[i];
+            return sum;
+        }
+
+        template<typename E>
+        void axpy(double multiplier, const E *x, double *y, long n) {
+            for (long i = 0; i < n; ++i)
+                y[i] += multiplier * (typename Widened<E>::type) x[i];
+        }
+
+        template<typename E>
+        void axpyReplicas(const double *multipliers, const E *const *x, int rows, double *y, int count, long n) {
+            for (int t = 0; t < rows; ++t)
+                for (int r = 0; r < count; ++r)
+                    axpy(multipliers[t * count + r], x[t], y + r * n, n);
+        }
+    }
+
+#ifdef MARS_CI_X86_KERNELS
+    namespace AVX2 {
+        __attribute__((target("avx2,fma"))) inline double sum(__m256d v) {
+            __m128d half = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+            return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+        }
+
+        __attribute__((target("avx2,fma"))) inline double dot(const float *a, const float *b, long n) {
+            __m256d acc_low = _mm256_setzero_pd(), acc_high = _mm256_setzero_pd();
+            long i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m256 product = _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                acc_low = _mm256_add_pd(acc_low, _mm256_cvtps_pd(_mm256_castps256_ps128(product)));
+                acc_high = _mm256_add_pd(acc_high, _mm256_cvtps_pd(_mm256_extractf128_ps(product, 1)));
+            }
+            double result = sum(_mm256_add_pd(acc_low, acc_high));
+            for (; i < n; ++i)
+                result += a[i] * b[i];
+            return result;
+        }
+
+        __attribute__((target("avx2,fma"))) inline double dot(const double *a, const double *b, long n) {
+            __m256d acc_0 = _mm256_setzero_pd(), acc_1 = _mm256_setzero_pd();
+            long i = 0;
+            for (; i + 8 <= n; i += 8) {
+                acc_0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), acc_0);
+                acc_1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), acc_1);
+            }
+            double result = sum(_mm256_add_pd(acc_0, acc_1));
+            for (; i < n; ++i)
+                result += a[i] * b[i];
+            return result;
+        }
+
+        __attribute__((target("avx2,fma"))) inline void axpy(double multiplier, const float *x, double *y, long n) {
+            __m256d m = _mm256_set1_pd(multiplier);
+            long i = 0;
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(y + i, _mm256_fmadd_pd(m, _mm256_cvtps_pd(_mm_loadu_ps(x + i)), _mm256_loadu_pd(y + i)));
+            for (; i < n; ++i)
+                y[i] += multiplier * x[i];
+        }
+
+        __attribute__((target("avx2,fma"))) inline void axpy(double multiplier, const double *x, double *y, long n) {
+            __m256d m = _mm256_set1_pd(multiplier);
+            long i = 0;
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(y + i, _mm256_fmadd_pd(m, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+            for (; i < n; ++i)
+                y[i] += multiplier * x[i];
+        }
+
+        /**
+         * Update P replicas whose values are n apart with a tile of C rows converted to double.
+         * Values are loaded and stored once for the whole tile.
+         */
+        template<int C, int P>
+        __attribute__((target("avx2,fma")))
+        void axpyTile(const double *multipliers, const double (*row_values)[REPLICA_CHUNK], long length, double *y,
+                      int count, long n) {
+            long i = 0;
+            for (; i + 4 <= length; i += 4) {
+                __m256d xs[C], acc[P];
+                for (int t = 0; t < C; ++t)
+                    xs[t] = _mm256_load_pd(&row_values[t][i]);
+                for (int p = 0; p < P; ++p)
+                    acc[p] = _mm256_loadu_pd(y + p * n + i);
+                for (int t = 0; t < C; ++t)
+                    for (int p = 0; p < P; ++p)
+                        acc[p] = _mm256_fmadd_pd(xs[t], _mm256_broadcast_sd(multipliers + t * count + p), acc[p]);
+                for (int p = 0; p < P; ++p)
+                    _mm256_storeu_pd(y + p * n + i, acc[p]);
+            }
+            for (; i < length; ++i)
+                for (int p = 0; p < P; ++p)
+                    for (int t = 0; t < C; ++t)
+                        y[p * n + i] += multipliers[t * count + p] * row_values[t][i];
+        }
+
+        /**
+         * Update Q replicas with a tile of rows, a row at a time if the tile holds fewer than C rows.
+         */
+        template<int C, int Q>
+        __attribute__((target("avx2,fma")))
+        void axpyBlock(const double *multipliers, int rows, const double (*row_values)[REPLICA_CHUNK], long length,
+                       double *y, int count, long n) {
+            if (rows == C) {
+                axpyTile<C, Q>(multipliers, row_values, length, y, count, n);
+                return;
+            }
+            for (int t = 0; t < rows; ++t)
+                axpyTile<1, Q>(multipliers + t * count, row_values + t, length, y, count, n);
+        }
+
+        template<typename E>
+        __attribute__((target("avx2,fma")))
+        void axpyReplicas(const double *multipliers, const E *const *x, int rows, double *y, int count, long n) {
+            // Tiles of 4 rows by 4 replicas keep 8 vectors in registers
+            const int C = 4, P = 4;
+            alignas(32) double row_values[C][REPLICA_CHUNK];
+            for (int first = 0; first < rows; first += C) {
+                int tile_rows = rows - first < C ? rows - first : C;
+                const double *tile_multipliers = multipliers + first * count;
+                for (long begin = 0; begin < n; begin += REPLICA_CHUNK) {
+                    long length = begin + REPLICA_CHUNK < n ? REPLICA_CHUNK : n - begin;
+                    widenRows(x + first, tile_rows, begin, length, row_values);
+                    int r = 0;
+                    for (; r + P <= count; r += P)
+                        axpyBlock<C, P>(tile_multipliers + r, tile_rows, row_values, length, y + r * n + begin,
+                                        count, n);
+                    for (; r < count; ++r)
+                        axpyBlock<C, 1>(tile_multipliers + r, tile_rows, row_values, length, y + r * n + begin,
+                                        count, n);
+                }
+            }
+        }
+    }
+
+    namespace AVX2Packed {
+        // Reduced precision rows are converted 8 elements at a time
+        __attribute__((target("avx2,fma,f16c"))) inline __m256 load(const Half *x) {
+            return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) x));
+        }
+
+        __attribute__((target("avx2,fma,f16c"))) inline __m256 load(const BFloat16 *x) {
+            return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) x)), 16));
+        }
+
+        __attribute__((target("avx2,fma,f16c"))) inline __m256 load(const int8_t *x) {
+            return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) x)));
+        }
+
+        template<typename E>
+        __attribute__((target("avx2,fma,f16c")))
+        double dot(const E *a, const float *b, long n) {
+            __m256d acc_low = _mm256_setzero_pd(), acc_high = _mm256_setzero_pd();
+            long i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m256 product = _mm256_mul_ps(load(a + i), _mm256_loadu_ps(b + i));
+                acc_low = _mm256_add_pd(acc_low, _mm256_cvtps_pd(_mm256_castps256_ps128(product)));
+                acc_high = _mm256_add_pd(acc_high, _mm256_cvtps_pd(_mm256_extractf128_ps(product, 1)));
+            }
+            double result = AVX2::sum(_mm256_add_pd(acc_low, acc_high));
+            for (; i < n; ++i)
+                result += (float) a[i] * b[i];
+            return result;
+        }
+
+        template<typename E>
+        __attribute__((target("avx2,fma,f16c")))
+        void axpy(double multiplier, const E *x, double *y, long n) {
+            __m256d m = _mm256_set1_pd(multiplier);
+            long i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m256 xs = load(x + i);
+                _mm256_storeu_pd(y + i, _mm256_fmadd_pd(m, _mm256_cvtps_pd(_mm256_castps256_ps128(xs)),
+                                                        _mm256_loadu_pd(y + i)));
+                _mm256_storeu_pd(y + i + 4, _mm256_fmadd_pd(m, _mm256_cvtps_pd(_mm256_extractf128_ps(xs, 1)),
+                                                            _mm256_loadu_pd(y + i + 4)));
+            }
+            for (; i < n; ++i)
+                y[i] += multiplier * (float) x[i];
+        }
+    }
+
+    namespace AVX512 {
+        __attribute__((target("avx512f"))) inline __m512d widen(__m256 v) {
+            // Masked conversion avoids reading an undefined pass-through register
+            return _mm512_maskz_cvtps_pd(0xFF, v);
+        }
+
+        __attribute__((target("avx512f"))) inline double sum(__m512d v) {
+            alignas(64) double lanes[8];
+            _mm512_store_pd(lanes, v);
+            return ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));
+        }
+
+        __attribute__((target("avx512f"))) inline double dot(const float *a, const float *b, long n) {
+            __m512d acc_low = _mm512_setzero_pd(), acc_high = _mm512_setzero_pd();
+            long i = 0;
+            for (; i + 16 <= n; i += 16) {
+                acc_low = _mm512_add_pd(acc_low, widen(_mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+                acc_high = _mm512_add_pd(acc_high,
+                                         widen(_mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8))));
+            }
+            double result = sum(_mm512_add_pd(acc_low, acc_high));
+            for (; i < n; ++i)
+                result += a[i] * b[i];
+            return result;
+        }
+
+        __attribute__((target("avx512f"))) inline double dot(const double *a, const double *b, long n) {
+            __m512d acc_0 = _mm512_setzero_pd(), acc_1 = _mm512_setzero_pd();
+            long i = 0;
+            for (; i + 16 <= n; i += 16) {
+                acc_0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), acc_0);
+                acc_1 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8), acc_1);
+            }
+            double result = sum(_mm512_add_pd(acc_0, acc_1));
+            for (; i < n; ++i)
+                result += a[i] * b[i];
+            return result;
+        }
+
+        __attribute__((target("avx512f"))) inline void axpy(double multiplier, const float *x, double *y, long n) {
+            __m512d m = _mm512_set1_pd(multiplier);
+            long i = 0;
+            for (; i + 8 <= n; i += 8)
+                _mm512_storeu_pd(y + i, _mm512_fmadd_pd(m, widen(_mm256_loadu_ps(x + i)), _mm512_loadu_pd(y + i)));
+            for (; i < n; ++i)
+                y[i] += multiplier * x[i];
+        }
+
+        __attribute__((target("avx512f"))) inline void axpy(double multiplier, const double *x, double *y, long n) {
+            __m512d m = _mm512_set1_pd(multiplier);
+            long i = 0;
+            for (; i + 8 <= n; i += 8)
+                _mm512_storeu_pd(y + i, _mm512_fmadd_pd(m, _mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i)));
+            for (; i < n; ++i)
+                y[i] += multiplier * x[i];
+        }
+
+        /**
+         * Update P replicas whose values are n apart with a tile of C rows converted to double,
+         * two vectors of elements at a time.
+         */
+        template<int C, int P>
+        __attribute__((target("avx512f")))
+        void axpyTile(const double *multipliers, const double (*row_values)[REPLICA_CHUNK], long length, double *y,
+                      int count, long n) {
+            long i = 0;
+            for (; i + 16 <= length; i += 16) {
+                __m512d xs[C][2], acc[P][2];
+                for (int t = 0; t < C; ++t)
+                    for (int u = 0; u < 2; ++u)
+                        xs[t][u] = _mm512_load_pd(&row_values[t][i + 8 * u]);
+                for (int p = 0; p < P; ++p)
+                    for (int u = 0; u < 2; ++u)
+                        acc[p][u] = _mm512_loadu_pd(y + p * n + i + 8 * u);
+                for (int t = 0; t < C; ++t) {
+                    for (int p = 0; p < P; ++p) {
+                        __m512d multiplier = _mm512_set1_pd(multipliers[t * count + p]);
+                        for (int u = 0; u < 2; ++u)
+                            acc[p][u] = _mm512_fmadd_pd(xs[t][u], multiplier, acc[p][u]);
+                    }
+                }
+                for (int p = 0; p < P; ++p)
+                    for (int u = 0; u < 2; ++u)
+                        _mm512_storeu_pd(y + p * n + i + 8 * u, acc[p][u]);
+            }
+            for (; i < length; ++i)
+                for (int p = 0; p < P; ++p)
+                    for (int t = 0; t < C; ++t)
+                        y[p * n + i] += multipliers[t * count + p] * row_values[t][i];
+        }
+
+        /**
+         * Update Q replicas with a tile of rows, a row at a time if the tile holds fewer than C rows.
+         */
+        template<int C, int Q>
+        __attribute__((target("avx512f")))
+        void axpyBlock(const double *multipliers, int rows, const double (*row_values)[REPLICA_CHUNK], long length,
+                       double *y, int count, long n) {
+            if (rows == C) {
+                axpyTile<C, Q>(multipliers, row_values, length, y, count, n);
+                return;
+            }
+            for (int t = 0; t < rows; ++t)
+                axpyTile<1, Q>(multipliers + t * count, row_values + t, length, y, count, n);
+        }
+
+        template<typename E>
+        __attribute__((target("avx512f")))
+        void axpyReplicas(const double *multipliers, const E *const *x, int rows, double *y, int count, long n) {
+            // Tiles of 8 rows by 4 replicas keep 24 vectors in registers
+            const int C = 8, P = 4;
+            alignas(64) double row_values[C][REPLICA_CHUNK];
+            for (int first = 0; first < rows; first += C) {
+                int tile_rows = rows - first < C ? rows - first : C;
+                const double *tile_multipliers = multipliers + first * count;
+                for (long begin = 0; begin < n; begin += REPLICA_CHUNK) {
+                    long length = begin + REPLICA_CHUNK < n ? REPLICA_CHUNK : n - begin;
+                    widenRows(x + first, tile_rows, begin, length, row_values);
+                    int r = 0;
+                    for (; r + P <= count; r += P)
+                        axpyBlock<C, P>(tile_multipliers + r, tile_rows, row_values, length, y + r * n + begin,
+                                        count, n);
+                    for (; r < count; ++r)
+                        axpyBlock<C, 1>(tile_multipliers + r, tile_rows, row_values, length, y + r * n + begin,
+                                        count, n);
+                }
+            }
+        }
+    }
+
+    namespace AVX512Packed {
+        // Reduced precision rows are converted 16 elements at a time; masked forms avoid reading undefined
+        // pass-through registers
+        __attribute__((target("avx512f"))) inline __m512 load(const Half *x) {
+            return _mm512_maskz_cvtph_ps(0xFFFF, _mm256_loadu_si256((const __m256i *) x));
+        }
+
+        __attribute__((target("avx512f"))) inline __m512 load(const BFloat16 *x) {
+            __m512i bits = _mm512_maskz_cvtepu16_epi32(0xFFFF, _mm256_loadu_si256((const __m256i *) x));
+            return _mm512_castsi512_ps(_mm512_maskz_slli_epi32(0xFFFF, bits, 16));
+        }
+
+        __attribute__((target("avx512f"))) inline __m512 load(const int8_t *x) {
+            return _mm512_maskz_cvtepi32_ps(0xFFFF, _mm512_maskz_cvtepi8_epi32(0xFFFF, _mm_loadu_si128((const __m128i *) x)));
+        }
+
+        __attribute__((target("avx512f"))) inline __m256 low(__m512 v) {
+            return _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(v), 0));
+        }
+
+        __attribute__((target("avx512f"))) inline __m256 high(__m512 v) {
+            return _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(v), 1));
+        }
+
+        template<typename E>
+        __attribute__((target("avx512f")))
+        double dot(const E *a, const float *b, long n) {
+            __m512d acc_low = _mm512_setzero_pd(), acc_high = _mm512_setzero_pd();
+            long i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m512 product = _mm512_mul_ps(load(a + i), _mm512_loadu_ps(b + i));
+                acc_low = _mm512_add_pd(acc_low, AVX512::widen(low(product)));
+                acc_high = _mm512_add_pd(acc_high, AVX512::widen(high(product)));
+            }
+            double result = AVX512::sum(_mm512_add_pd(acc_low, acc_high));
+            for (; i < n; ++i)
+                result += (float) a[i] * b[i];
+            return result;
+        }
+
+        template<typename E>
+        __attribute__((target("avx512f")))
+        void axpy(double multiplier, const E *x, double *y, long n) {
+            __m512d m = _mm512_set1_pd(multiplier);
+            long i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m512 xs = load(x + i);
+                _mm512_storeu_pd(y + i, _mm512_fmadd_pd(m, AVX512::widen(low(xs)), _mm512_loadu_pd(y + i)));
+                _mm512_storeu_pd(y + i + 8, _mm512_fmadd_pd(m, AVX512::widen(high(xs)), _mm512_loadu_pd(y + i + 8)));
+            }
+            for (; i < n; ++i)
+                y[i] += multiplier * (float) x[i];
+        }
+    }
+#endif
+
+    /**
+     * Check if kernel family may be used according to the MARS_CI_KERNELS environment variable.
+     * @param name Kernel family name
+     * @return True if allowed
+     */
+    inline bool allowed(const char *name) {
+        static const char *order[] = {"portable", "avx2", "avx512"};
+        const char *limit = std::getenv("MARS_CI_KERNELS");
+        if (limit == nullptr)
+            return true;
+        int name_rank = -1, limit_rank = -1;
+        for (int rank = 0; rank < 3; ++rank) {
+            if (std::strcmp(order[rank], name) == 0)
+                name_rank = rank;
+            if (std::strcmp(order[rank], limit) == 0)
+                limit_rank = rank;
+        }
+        return limit_rank < 0 or name_rank <= limit_rank;
+    }
+
+    template<typename E, typename T>
+    KernelSet<E, T> select() {
+        return KernelSet<E, T>{"portable", Portable::dot<E, T>, Portable::axpy<E>, Portable::axpyReplicas<E>};
+    }
+
+#ifdef MARS_CI_X86_KERNELS
+    template<typename T>
+    KernelSet<T> selectX86() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") and allowed("avx512"))
+            return KernelSet<T>{"avx512", AVX512::dot, AVX512::axpy, AVX512::axpyReplicas<T>};
+        if (__builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma") and allowed("avx2"))
+            return KernelSet<T>{"avx2", AVX2::dot, AVX2::axpy, AVX2::axpyReplicas<T>};
+        return KernelSet<T>{"portable", Portable::dot<T, T>, Portable::axpy<T>, Portable::axpyReplicas<T>};
+    }
+
+    template<typename E>
+    KernelSet<E, float> selectPackedX86() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") and allowed("avx512"))
+            return KernelSet<E, float>{"avx512", AVX512Packed::dot<E>, AVX512Packed::axpy<E>,
+                                       AVX512::axpyReplicas<E>};
+        if (__builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma") and __builtin_cpu_supports("f16c") and
+            allowed("avx2"))
+            return KernelSet<E, float>{"avx2", AVX2Packed::dot<E>, AVX2Packed::axpy<E>, AVX2::axpyReplicas<E>};
+        return KernelSet<E, float>{"portable", Portable::dot<E, float>, Portable::axpy<E>, Portable::axpyReplicas<E>};
+    }
+
+    template<>
+    inline KernelSet<float> select<float, float>() { return selectX86<float>(); }
+
+    template<>
+    inline KernelSet<double> select<double, double>() { return selectX86<double>(); }
+
+    template<>
+    inline KernelSet<Half> select<Half, float>() { return selectPackedX86<Half>(); }
+
+    template<>
+    inline KernelSet<BFloat16> select<BFloat16, float>() { return selectPackedX86<BFloat16>(); }
+
+    template<>
+    inline KernelSet<int8_t> select<int8_t, float>() { return selectPackedX86<int8_t>(); }
+#endif
+
+    /**
+     * Get kernel set chosen for the running CPU.
+     * @tparam E Row element storage type
+     * @tparam T Value type of the vectors rows are multiplied by
+     * @return Kernel set
+     */
+    template<typename E, typename T = typename Widened<E>::type>
+    const KernelSet<E, T> &kernels() {
+        static const KernelSet<E, T> kernel_set = select<E, T>();
+        return kernel_set;
+    }
+
+    template<typename E, typename T>
+    double dot(const E *a, const T *b, long n) {
+        return kernels<E, T>().dot(a, b, n);
+    }
+
+    template<typename E>
+    void axpy(double multiplier, const E *x, double *y, long n) {
+        kernels<E>().axpy(multiplier, x, y, n);
+    }
+
+    template<typename E>
+    void axpyReplicas(const double *multipliers, const E *const *x, int rows, double *y, int count, long n) {
+        kernels<E>().axpyReplicas(multipliers, x, rows, y, count, n);
+    }
+}
+
+#endif //MARS_CI_KERNELS_H
@@ -5,20 +5,104 @@
 #ifndef MARS_CI_LATTICE_H
 #define MARS_CI_LATTICE_H
 
-#include <string>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Kernels.h"
+#include "LatticeFile.h"
 #include "Random.h"
 
 /**
- * Represents a bi-dimensional square lattice that describes spin interaction.
- * @tparam T
+ * Represents a bi-dimensional square symmetric lattice that describes spin interaction.
+ * Elements are stored either as a dense matrix or in compressed sparse row (CSR) format.
+ * A dense matrix may be packed into a reduced precision storage type (see pack) that is converted to T
+ * on the fly: half precision, bfloat16, or int8 with a scale per row. Rows of an int8 lattice with different
+ * scales are symmetric only within half of a quantization step.
+ * @tparam T Lattice element value type
  */
 template<typename T>
 class Lattice {
 private:
     int mat_size = 0;
-    T *mat_values = nullptr;
+    const T *mat_values = nullptr;
+
+    // CSR storage, used instead of mat_values if the lattice is sparse
+    long *row_offsets = nullptr;
+    int *col_indices = nullptr;
+    T *nz_values = nullptr;
+
+    // Reduced precision dense storage, used instead of mat_values if packed_type is set
+    uint32_t packed_type = 0;
+    const void *packed_values = nullptr;
+    const float *row_scales = nullptr;
+
+    // Copies share element storage, the last one releases it
+    std::shared_ptr<const void> storage{};
+
+    /**
+     * Call operation with a row of the packed matrix and its scale.
+     * @param x Row index
+     * @param operation Function that takes row pointer and row scale
+     */
+    template<typename F>
+    void withPackedRow(int x, F operation) const;
+
+    /**
+     * Perform axpyReplicas on rows of a dense matrix, scaling the multipliers of int8 rows.
+     * @tparam E Storage type
+     * @param matrix Element array pointer
+     */
+    template<typename E>
+    void axpyRows(const E *matrix, const int *rows, int row_count, const double *multipliers, int count,
+                  double *values) const;
+
+    /**
+     * Convert dense matrix element values to a reduced precision storage type.
+     * @tparam E Storage type
+     */
+    template<typename E>
+    void packValues();
+
+    /**
+     * Load dense matrix element values from stream.
+     * @param ifs Stream positioned right after the lattice size
+     */
+    void loadDense(std::istream &ifs);
+
+    /**
+     * Load edge list from stream and build CSR storage.
+     * @param ifs Stream positioned right after the header line
+     * @param edge_count Quantity of edges in the list
+     * @throws std::runtime_error if an edge is missing or its spin index is out of range
+     */
+    void loadEdges(std::istream &ifs, long edge_count);
+
+    /**
+     * Map binary lattice file to memory. The mapping is read-only and shared with other processes,
+     * element values are converted to a private copy only if the file data type is another full precision type.
+     * Reduced precision matrices are used as they are stored.
+     * @param filename Binary lattice file path
+     */
+    void mapBinary(const std::string &filename);
+
+    /**
+     * Map a binary lattice from an open file or shared memory object descriptor, see mapBinary.
+     * @param fd Descriptor open for reading
+     * @param name Lattice source name used in error messages
+     */
+    void mapDescriptor(int fd, const std::string &name);
+
 public:
     /**
      * Default Lattice constructor.
@@ -34,67 +118,489 @@ public:
 
     /**
      * Lattice constructor that loads element values from specified filename.
+     * A file whose first line holds a single number N is read as a dense N x N matrix.
+     * A file whose first line holds two numbers "N E" is read as a sparse edge list:
+     * E lines of "i j J_ij" with zero-based indices follow, each edge sets both J_ij and J_ji.
+     * A binary lattice file (see LatticeFile.h) is mapped to memory instead of being read.
+     * A filename that starts with LatticeFile::SHARED_PREFIX names a POSIX shared memory object created by share,
+     * it is mapped read-only in the same way.
      * @param filename Filename where Lattice values are stored
      */
     explicit Lattice(const std::string &filename);
 
+    /**
+     * Copy the dense matrix to a new POSIX shared memory object in the binary lattice file layout,
+     * in its current storage type. Other processes attach to it with the LatticeFile::SHARED_PREFIX initializer.
+     * The object persists until it is removed with shm_unlink.
+     * @param name Shared memory object name, starting with a slash
+     * @throws std::invalid_argument if the lattice is sparse
+     * @throws std::runtime_error if the object cannot be created
+     */
+    void share(const std::string &name) const;
+
     /**
      * Get element value by indices.
      * @param x Column index
      * @param y Row index
      * @return Element value
      */
-    T &operator()(int x, int y);
+    T operator()(int x, int y) const;
+
+    /**
+     * Calculate sum of lattice(x, j) * vector[j] over first <= j < last.
+     * Only non-zero elements are visited if the lattice is sparse.
+     * @param x Row index
+     * @param vector Value array pointer, must hold size() values
+     * @param first Index of the first column to take into account
+     * @param last Index after the last column to take into account, -1 for size()
+     * @return Sum value
+     */
+    double dot(int x, const T *vector, int first = 0, int last = -1) const;
+
+    /**
+     * Add lattice(x, j) * multiplier to vector[j] for every first <= j < last.
+     * Only non-zero elements are visited if the lattice is sparse.
+     * @param x Row index
+     * @param multiplier Row multiplier
+     * @param vector Value array pointer, must hold size() values
+     * @param first Index of the first column to take into account
+     * @param last Index after the last column to take into account, -1 for size()
+     */
+    void axpy(int x, double multiplier, double *vector, int first = 0, int last = -1) const;
+
+    /**
+     * Add sum of lattice(rows[t], j) * multipliers[t * count + r] over t < row_count to values[r * size() + j]
+     * for every j and r < count. This is a rank-row_count update of the matrix of count vectors stored one after
+     * another (replica-major): every row is read once for all vectors.
+     * Only non-zero elements are visited if the lattice is sparse.
+     * @param rows Row index array pointer
+     * @param row_count Row count
+     * @param multipliers Row multiplier array pointer, count multipliers per row
+     * @param count Vector count
+     * @param values Replica-major value array pointer, must hold size() * count values
+     */
+    void axpyReplicas(const int *rows, int row_count, const double *multipliers, int count, double *values) const;
+
+    /**
+     * Get a copy of the lattice with the dense matrix packed into another storage type.
+     * Sparse lattices and lattices that are already stored in the requested type are returned as they are.
+     * @param data_type LatticeFile::DataType of the storage: FLOAT16, BFLOAT16 or INT8, or dataType<T>()
+     * @return Lattice object
+     * @throws std::invalid_argument if the storage type is not supported
+     */
+    Lattice<T> pack(uint32_t data_type) const;
+
+    /**
+     * Get storage type of the element values.
+     * @return LatticeFile::DataType of the storage
+     */
+    uint32_t storageType() const;
+
+    /**
+     * Check if lattice is stored in sparse format.
+     * @return True if sparse
+     */
+    bool sparse() const;
 
     /**
      * Get Lattice size.
      * @return Lattice size
      */
-    int size();
+    int size() const;
 };
 
 template<typename T>
 Lattice<T>::Lattice(const std::string &filename) {
+    std::string shared_prefix = LatticeFile::SHARED_PREFIX;
+    if (filename.compare(0, shared_prefix.size(), shared_prefix) == 0) {
+        std::string name = filename.substr(shared_prefix.size());
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open shared lattice " + name);
+        try {
+            mapDescriptor(fd, filename);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        return;
+    }
+    if (LatticeFile::isBinary(filename)) {
+        mapBinary(filename);
+        return;
+    }
     auto ifs = std::ifstream(filename);
-    int k = 0;
-    ifs >> k;
-    mat_size = k;
-    mat_values = new T[mat_size * mat_size];
+    std::string header;
+    getline(ifs, header);
+    std::istringstream header_parser(header);
+    long edge_count = -1;
+    header_parser >> mat_size >> edge_count >> std::ws;
+    if (edge_count >= 0 and header_parser.eof()) {
+        loadEdges(ifs, edge_count);
+    } else {
+        // Matrix values may follow the size on the same line
+        ifs.clear();
+        ifs.seekg(0);
+        ifs >> mat_size;
+        loadDense(ifs);
+    }
+}
+
+template<typename T>
+void Lattice<T>::loadDense(std::istream &ifs) {
+    T *values = new T[(long) mat_size * mat_size];
     for (int i = 0; i < mat_size; ++i) {
         for (int j = 0; j < mat_size; ++j) {
             float tmp = 0;
             ifs >> tmp;
             if (i <= j) {
-                mat_values[i * mat_size + j] = tmp;
-                mat_values[j * mat_size + i] = tmp;
+                values[(long) i * mat_size + j] = tmp;
+                values[(long) j * mat_size + i] = tmp;
             }
         }
     }
+    mat_values = values;
+    storage.reset(values, std::default_delete<T[]>());
+}
+
+template<typename T>
+void Lattice<T>::mapBinary(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open lattice file " + filename);
+    try {
+        mapDescriptor(fd, filename);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+template<typename T>
+void Lattice<T>::mapDescriptor(int fd, const std::string &filename) {
+    LatticeFile::Header header{};
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+        throw std::runtime_error(filename + " is not a binary lattice file");
+    LatticeFile::checkHeader(header, filename);
+    if (not(header.flags & LatticeFile::SYMMETRIC))
+        throw std::runtime_error(filename + ": only symmetric lattices are supported");
+    mat_size = (int) header.size;
+    uint64_t data_length = LatticeFile::dataLength(header);
+    uint64_t mapping_length = header.data_offset + data_length;
+
+    // Reading past the end of a truncated file through the mapping raises SIGBUS, so check the size first
+    struct stat st{};
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error("Failed to stat lattice file " + filename);
+    uint64_t file_length = st.st_size;
+    if (file_length < header.data_offset or file_length - header.data_offset < data_length)
+        throw std::runtime_error(filename + " is truncated: expected " + std::to_string(mapping_length) +
+                                 " bytes, found " + std::to_string(file_length));
+
+    void *mapping = mmap(nullptr, mapping_length, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("Failed to map lattice file " + filename);
+    const char *data = (const char *) mapping + header.data_offset;
+
+    if (header.data_type != LatticeFile::FLOAT32 and header.data_type != LatticeFile::FLOAT64) {
+        packed_type = header.data_type;
+        packed_values = data;
+        if (header.data_type == LatticeFile::INT8)
+            row_scales = (const float *) (data + LatticeFile::scaleOffset(header.size));
+    }
+    if (packed_type != 0 or header.data_type == LatticeFile::dataType<T>()) {
+        mat_values = packed_type != 0 ? nullptr : (const T *) data;
+        storage.reset(mapping, [mapping_length](void *address) { munmap(address, mapping_length); });
+        return;
+    }
+    T *values = new T[(long) mat_size * mat_size];
+    for (long i = 0; i < (long) mat_size * mat_size; ++i)
+        values[i] = header.data_type == LatticeFile::FLOAT32 ? (T) ((const float *) data)[i] :
+                    (T) ((const double *) data)[i];
+    munmap(mapping, mapping_length);
+    mat_values = values;
+    storage.reset(values, std::default_delete<T[]>());
+}
+
+template<typename T>
+void Lattice<T>::loadEdges(std::istream &ifs, long edge_count) {
+    struct Edge {
+        int x, y;
+        T value;
+    };
+    std::vector<Edge> edges;
+    edges.reserve(2 * edge_count);
+    for (long edge_index = 0; edge_index < edge_count; ++edge_index) {
+        int x = 0, y = 0;
+        float tmp = 0;
+        ifs >> x >> y >> tmp;
+        if (not ifs or x < 0 or x >= mat_size or y < 0 or y >= mat_size)
+            throw std::runtime_error("Invalid or missing lattice edge " + std::to_string(edge_index) + " of " +
+                                     std::to_string(edge_count));
+        edges.push_back(Edge{x, y, (T) tmp});
+        if (x != y)
+            edges.push_back(Edge{y, x, (T) tmp});
+    }
+    std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {
+        return a.x < b.x or (a.x == b.x and a.y < b.y);
+    });
+
+    // Duplicate edges are summed up
+    row_offsets = new long[mat_size + 1]();
+    col_indices = new int[edges.size()];
+    nz_values = new T[edges.size()];
+    long nz_count = 0;
+    for (unsigned long edge_index = 0; edge_index < edges.size(); ++edge_index) {
+        const Edge &edge = edges[edge_index];
+        if (nz_count > 0 and edge_index > 0 and edges[edge_index - 1].x == edge.x and
+            edges[edge_index - 1].y == edge.y) {
+            nz_values[nz_count - 1] += edge.value;
+            continue;
+        }
+        col_indices[nz_count] = edge.y;
+        nz_values[nz_count] = edge.value;
+        row_offsets[edge.x + 1]++;
+        nz_count++;
+    }
+    for (int i = 0; i < mat_size; ++i)
+        row_offsets[i + 1] += row_offsets[i];
+    int *indices = col_indices;
+    T *nz = nz_values;
+    storage.reset(row_offsets, [indices, nz](long *offsets) {
+        delete[] offsets;
+        delete[] indices;
+        delete[] nz;
+    });
 }
 
 template<typename T>
 Lattice<T>::Lattice(int size, bool randomize) {
     mat_size = size;
-    mat_values = new T[mat_size * mat_size];
+    T *values = new T[(long) mat_size * mat_size];
+    Random::Stream stream(0, Random::LATTICE_STREAM);
     for (int i = 0; i < mat_size; ++i) {
-        for (int j = 0; j < mat_size; ++j) {
-            if (randomize and i > j) {
-                mat_values[i * mat_size + j] = mat_values[j * mat_size + i] = Random::uniform(-1, 1);
-            } else if (not randomize or i == j) {
-                mat_values[i * mat_size + j] = 0;
-            }
-        }
+        T *row = values + (long) i * mat_size;
+        if (randomize)
+            stream.fill(row, i, -1, 1);
+        else
+            std::fill(row, row + i, 0);
+        row[i] = 0;
+    }
+    for (int i = 0; i < mat_size; ++i)
+        for (int j = i + 1; j < mat_size; ++j)
+            values[(long) i * mat_size + j] = values[(long) j * mat_size + i];
+    mat_values = values;
+    storage.reset(values, std::default_delete<T[]>());
+}
+
+template<typename T>
+template<typename F>
+void Lattice<T>::withPackedRow(int x, F operation) const {
+    long offset = (long) x * mat_size;
+    switch (packed_type) {
+        case LatticeFile::FLOAT16:
+            operation((const Half *) packed_values + offset, 1.);
+            break;
+        case LatticeFile::BFLOAT16:
+            operation((const BFloat16 *) packed_values + offset, 1.);
+            break;
+        default:
+            operation((const int8_t *) packed_values + offset, (double) row_scales[x]);
+            break;
+    }
+}
+
+template<typename T>
+template<typename E>
+void Lattice<T>::packValues() {
+    bool scaled = LatticeFile::dataType<E>() == LatticeFile::INT8;
+    long element_count = (long) mat_size * mat_size;
+    long scale_offset = scaled ? (long) LatticeFile::scaleOffset(mat_size) : element_count * (long) sizeof(E);
+    // Row scales are kept in the same allocation as the elements
+    auto data = new char[scale_offset + mat_size * sizeof(float)];
+    auto values = (E *) data;
+    auto scales = (float *) (data + scale_offset);
+    std::vector<float> row(mat_size);
+    for (int i = 0; i < mat_size; ++i) {
+        for (int j = 0; j < mat_size; ++j)
+            row[j] = (float) (*this)(i, j);
+        scales[i] = scaled ? LatticeFile::rowScale(row) : 1;
+        for (int j = 0; j < mat_size; ++j)
+            values[(long) i * mat_size + j] = LatticeFile::narrow<E>(row[j], scales[i]);
+    }
+    mat_values = nullptr;
+    packed_type = LatticeFile::dataType<E>();
+    packed_values = values;
+    row_scales = scaled ? scales : nullptr;
+    storage.reset(data, std::default_delete<char[]>());
+}
+
+template<typename T>
+Lattice<T> Lattice<T>::pack(uint32_t data_type) const {
+    if (sparse() or data_type == storageType())
+        return *this;
+    Lattice<T> lattice = *this;
+    switch (data_type) {
+        case LatticeFile::FLOAT16:
+            lattice.packValues<Half>();
+            break;
+        case LatticeFile::BFLOAT16:
+            lattice.packValues<BFloat16>();
+            break;
+        case LatticeFile::INT8:
+            lattice.packValues<int8_t>();
+            break;
+        default:
+            throw std::invalid_argument("Lattice storage type " + LatticeFile::typeName(data_type) + " is not supported");
+    }
+    return lattice;
+}
+
+template<typename T>
+void Lattice<T>::share(const std::string &name) const {
+    if (sparse())
+        throw std::invalid_argument("Sparse lattices cannot be shared");
+    LatticeFile::Header header = LatticeFile::makeHeader(storageType(), (uint64_t) mat_size);
+    uint64_t data_length = LatticeFile::dataLength(header);
+    uint64_t matrix_length = (uint64_t) mat_size * mat_size * LatticeFile::elementSize(header.data_type);
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create shared lattice " + name);
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, (off_t) (header.data_offset + data_length)) == 0)
+        mapping = mmap(nullptr, header.data_offset + data_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Failed to map shared lattice " + name);
     }
+
+    // Same layout as a binary lattice file; the padding before row scales is zero, as ftruncate leaves it
+    char *data = (char *) mapping + header.data_offset;
+    std::memcpy(data, packed_type != 0 ? packed_values : (const void *) mat_values, matrix_length);
+    if (row_scales != nullptr)
+        std::memcpy(data + LatticeFile::scaleOffset(header.size), row_scales, header.size * sizeof(float));
+    header.checksum = LatticeFile::checksum(header.checksum, data, data_length);
+    std::memcpy(mapping, &header, sizeof(header));
+    munmap(mapping, header.data_offset + data_length);
 }
 
 template<typename T>
-T &Lattice<T>::operator()(int x, int y) {
+uint32_t Lattice<T>::storageType() const {
+    return packed_type != 0 ? packed_type : LatticeFile::dataType<T>();
+}
+
+template<typename T>
+T Lattice<T>::operator()(int x, int y) const {
+    if (packed_type != 0) {
+        T value = 0;
+        withPackedRow(x, [&](const auto *row, double scale) { value = (T) ((float) row[y] * scale); });
+        return value;
+    }
+    if (sparse()) {
+        const int *row_begin = col_indices + row_offsets[x], *row_end = col_indices + row_offsets[x + 1];
+        const int *element = std::lower_bound(row_begin, row_end, y);
+        return element != row_end and *element == y ? nz_values[element - col_indices] : 0;
+    }
     // TODO(aryavorskiy): Probably another operator should be used here
-    return mat_values[x * mat_size + y];
+    return mat_values[(long) x * mat_size + y];
+}
+
+template<typename T>
+double Lattice<T>::dot(int x, const T *vector, int first, int last) const {
+    if (last < 0)
+        last = mat_size;
+    double sum = 0;
+    if (sparse()) {
+        long k = std::lower_bound(col_indices + row_offsets[x], col_indices + row_offsets[x + 1], first) - col_indices;
+        for (; k < row_offsets[x + 1] and col_indices[k] < last; ++k)
+            sum += nz_values[k] * vector[col_indices[k]];
+        return sum;
+    }
+    if (packed_type != 0) {
+        withPackedRow(x, [&](const auto *row, double scale) {
+            sum = Kernels::dot(row + first, vector + first, last - first) * scale;
+        });
+        return sum;
+    }
+    const T *row = mat_values + (long) x * mat_size;
+    return Kernels::dot(row + first, vector + first, last - first);
+}
+
+template<typename T>
+void Lattice<T>::axpy(int x, double multiplier, double *vector, int first, int last) const {
+    if (last < 0)
+        last = mat_size;
+    if (sparse()) {
+        long k = std::lower_bound(col_indices + row_offsets[x], col_indices + row_offsets[x + 1], first) - col_indices;
+        for (; k < row_offsets[x + 1] and col_indices[k] < last; ++k)
+            vector[col_indices[k]] += multiplier * nz_values[k];
+        return;
+    }
+    if (packed_type != 0) {
+        withPackedRow(x, [&](const auto *row, double scale) {
+            Kernels::axpy(multiplier * scale, row + first, vector + first, last - first);
+        });
+        return;
+    }
+    Kernels::axpy(multiplier, mat_values + (long) x * mat_size + first, vector + first, last - first);
+}
+
+template<typename T>
+void Lattice<T>::axpyReplicas(const int *rows, int row_count, const double *multipliers, int count,
+                              double *values) const {
+    if (sparse()) {
+        for (int t = 0; t < row_count; ++t)
+            for (long k = row_offsets[rows[t]]; k < row_offsets[rows[t] + 1]; ++k)
+                for (int r = 0; r < count; ++r)
+                    values[(long) r * mat_size + col_indices[k]] += multipliers[t * count + r] * nz_values[k];
+        return;
+    }
+    switch (packed_type) {
+        case 0:
+            axpyRows(mat_values, rows, row_count, multipliers, count, values);
+            break;
+        case LatticeFile::FLOAT16:
+            axpyRows((const Half *) packed_values, rows, row_count, multipliers, count, values);
+            break;
+        case LatticeFile::BFLOAT16:
+            axpyRows((const BFloat16 *) packed_values, rows, row_count, multipliers, count, values);
+            break;
+        default:
+            axpyRows((const int8_t *) packed_values, rows, row_count, multipliers, count, values);
+            break;
+    }
+}
+
+template<typename T>
+template<typename E>
+void Lattice<T>::axpyRows(const E *matrix, const int *rows, int row_count, const double *multipliers, int count,
+                          double *values) const {
+    std::vector<const E *> row_pointers(row_count);
+    for (int t = 0; t < row_count; ++t)
+        row_pointers[t] = matrix + (long) rows[t] * mat_size;
+    if (row_scales == nullptr) {
+        Kernels::axpyReplicas(multipliers, row_pointers.data(), row_count, values, count, mat_size);
+        return;
+    }
+    // Row scales are folded into the multipliers
+    std::vector<double> scaled(multipliers, multipliers + (long) row_count * count);
+    for (int t = 0; t < row_count; ++t)
+        for (int r = 0; r < count; ++r)
+            scaled[t * count + r] *= row_scales[rows[t]];
+    Kernels::axpyReplicas(scaled.data(), row_pointers.data(), row_count, values, count, mat_size);
+}
+
+template<typename T>
+bool Lattice<T>::sparse() const {
+    return row_offsets != nullptr;
 }
 
 template<typename T>
-int Lattice<T>::size() {
+int Lattice<T>::size() const {
     return mat_size;
 }
 
@@ -0,0 +1,295 @@
+#ifndef MARS_CI_LATTICEFILE_H
+#define MARS_CI_LATTICEFILE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "Float16.h"
+
+/**
+ * This namespace describes the binary lattice file format.
+ * A file starts with a Header followed by a dense row-major size x size element matrix
+ * located at data_offset, which is aligned to the memory page size so the matrix can be mapped directly.
+ * INT8 elements are multiplied by the scale of their row; size float32 row scales follow the matrix,
+ * starting at the next multiple of 8 bytes.
+ * The checksum is not verified when a file is mapped, since that would read the whole matrix up front;
+ * MARS_CI_convert verify checks it.
+ */
+namespace LatticeFile {
+    constexpr char MAGIC[8] = {'M', 'A', 'R', 'S', 'L', 'A', 'T', '\0'};
+    constexpr uint32_t VERSION = 1;
+    constexpr uint64_t DATA_ALIGNMENT = 4096;
+
+    /**
+     * Lattice initializer prefix of a POSIX shared memory object that holds a lattice in the binary file layout.
+     */
+    constexpr char SHARED_PREFIX[] = "shm:";
+
+    /**
+     * Element type identifiers.
+     */
+    enum DataType : uint32_t {
+        FLOAT32 = 1,
+        FLOAT64 = 2,
+        FLOAT16 = 3,
+        BFLOAT16 = 4,
+        INT8 = 5
+    };
+
+    /**
+     * Header flags.
+     */
+    enum Flags : uint32_t {
+        SYMMETRIC = 1
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t data_type;
+        uint64_t size;
+        uint32_t flags;
+        uint32_t reserved;
+        uint64_t data_offset;
+        uint64_t checksum;      // FNV-1a hash of the element matrix bytes, including row scales
+    };
+
+    /**
+     * Get data type identifier of a value type.
+     * @tparam T Element value type
+     * @return Data type identifier, 0 if type is not supported
+     */
+    template<typename T>
+    constexpr uint32_t dataType() {
+        return std::is_same<T, float>::value ? (uint32_t) FLOAT32 :
+               std::is_same<T, double>::value ? (uint32_t) FLOAT64 :
+               std::is_same<T, Half>::value ? (uint32_t) FLOAT16 :
+               std::is_same<T, BFloat16>::value ? (uint32_t) BFLOAT16 :
+               std::is_same<T, int8_t>::value ? (uint32_t) INT8 : 0;
+    }
+
+    /**
+     * Get element byte size of a data type.
+     * @param data_type Data type identifier
+     * @return Element size in bytes
+     */
+    inline uint64_t elementSize(uint32_t data_type) {
+        switch (data_type) {
+            case FLOAT32:
+                return sizeof(float);
+            case FLOAT64:
+                return sizeof(double);
+            case FLOAT16:
+            case BFLOAT16:
+                return sizeof(uint16_t);
+            case INT8:
+                return sizeof(int8_t);
+            default:
+                throw std::runtime_error("Unknown lattice data type " + std::to_string(data_type));
+        }
+    }
+
+    /**
+     * Get offset of the row scales from the start of the element matrix.
+     * @param size Lattice size
+     * @return Offset in bytes
+     */
+    inline uint64_t scaleOffset(uint64_t size) {
+        return (size * size + 7) / 8 * 8;
+    }
+
+    /**
+     * Get length of the element matrix, including row scales.
+     * @param header Lattice file header
+     * @return Length in bytes
+     */
+    inline uint64_t dataLength(const Header &header) {
+        if (header.data_type == INT8)
+            return scaleOffset(header.size) + header.size * sizeof(float);
+        return header.size * header.size * elementSize(header.data_type);
+    }
+
+    /**
+     * Get name of a data type, as accepted by parseType.
+     * @param data_type Data type identifier
+     * @return Data type name
+     */
+    inline std::string typeName(uint32_t data_type) {
+        static const char *names[] = {"unknown", "float", "double", "fp16", "bf16", "int8"};
+        return names[data_type <= INT8 ? data_type : 0];
+    }
+
+    /**
+     * Get data type by name.
+     * @param name Data type name: float, double, fp16, bf16 or int8
+     * @return Data type identifier
+     * @throws std::invalid_argument if the name is unknown
+     */
+    inline uint32_t parseType(const std::string &name) {
+        for (uint32_t data_type = FLOAT32; data_type <= INT8; ++data_type)
+            if (typeName(data_type) == name)
+                return data_type;
+        throw std::invalid_argument("Unknown lattice data type '" + name + "'");
+    }
+
+    /**
+     * Get scale of an INT8 row: the largest magnitude in the row maps to 127.
+     * @param row Row element values
+     * @return Row scale
+     */
+    inline float rowScale(const std::vector<float> &row) {
+        float magnitude = 0;
+        for (float value : row)
+            magnitude = std::max(magnitude, std::fabs(value));
+        return magnitude > 0 ? magnitude / 127 : 1;
+    }
+
+    /**
+     * Convert element value to a storage type.
+     * @tparam T Storage type
+     * @param value Element value
+     * @param scale Row scale, used by INT8 only
+     * @return Stored value
+     */
+    template<typename T>
+    T narrow(float value, float) {
+        return T(value);
+    }
+
+    template<>
+    inline int8_t narrow<int8_t>(float value, float scale) {
+        return (int8_t) std::max(-127.f, std::min(127.f, std::nearbyint(value / scale)));
+    }
+
+    /**
+     * Continue FNV-1a hash calculation over a byte range.
+     * @param hash Hash of the preceding bytes
+     * @param data Data pointer
+     * @param length Data length in bytes
+     * @return Hash value
+     */
+    inline uint64_t checksum(uint64_t hash, const void *data, uint64_t length) {
+        auto bytes = (const unsigned char *) data;
+        for (uint64_t i = 0; i < length; ++i)
+            hash = (hash ^ bytes[i]) * 0x100000001B3;
+        return hash;
+    }
+
+    constexpr uint64_t CHECKSUM_SEED = 0xCBF29CE484222325;
+
+    /**
+     * Check if the file starts with the binary lattice magic.
+     * @param filename File path
+     * @return True if file is a binary lattice
+     */
+    inline bool isBinary(const std::string &filename) {
+        std::ifstream ifs(filename, std::ios::binary);
+        char magic[sizeof(MAGIC)] = {};
+        ifs.read(magic, sizeof(magic));
+        return ifs.good() and std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    }
+
+    /**
+     * Create a header of a symmetric lattice with data right after the header page.
+     * The checksum is set to its seed value.
+     * @param data_type Element storage type
+     * @param size Lattice size
+     * @return Header
+     */
+    inline Header makeHeader(uint32_t data_type, uint64_t size) {
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.data_type = data_type;
+        header.size = size;
+        header.flags = SYMMETRIC;
+        header.data_offset = DATA_ALIGNMENT;
+        header.checksum = CHECKSUM_SEED;
+        return header;
+    }
+
+    /**
+     * Validate a binary lattice header.
+     * @param header Header read from the lattice source
+     * @param name Lattice source name used in error messages
+     * @throws std::runtime_error if the header is invalid
+     */
+    inline void checkHeader(const Header &header, const std::string &name) {
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+            throw std::runtime_error(name + " is not a binary lattice file");
+        if (header.version != VERSION)
+            throw std::runtime_error(name + ": unsupported lattice file version " + std::to_string(header.version));
+        elementSize(header.data_type);
+        if (header.data_offset % DATA_ALIGNMENT != 0)
+            throw std::runtime_error(name + ": misaligned lattice data");
+        // Keeps dataLength from overflowing on a corrupt size
+        if (header.size > (uint64_t) std::numeric_limits<int>::max() or
+            (header.size != 0 and header.size > std::numeric_limits<uint64_t>::max() / 8 / header.size))
+            throw std::runtime_error(name + ": invalid lattice size " + std::to_string(header.size));
+    }
+
+    /**
+     * Read and validate the header of a binary lattice file.
+     * @param filename File path
+     * @return Header
+     */
+    inline Header readHeader(const std::string &filename) {
+        std::ifstream ifs(filename, std::ios::binary);
+        Header header{};
+        ifs.read((char *) &header, sizeof(header));
+        if (not ifs.good())
+            throw std::runtime_error(filename + " is not a binary lattice file");
+        checkHeader(header, filename);
+        return header;
+    }
+
+    /**
+     * Write a lattice to a binary file.
+     * @tparam T Element storage type: float, double, Half, BFloat16 or int8_t
+     * @tparam L Lattice type, must provide size() and operator()(x, y)
+     * @param lattice Lattice to write
+     * @param filename File path
+     */
+    template<typename T, typename L>
+    void write(const L &lattice, const std::string &filename) {
+        Header header = makeHeader(dataType<T>(), (uint64_t) lattice.size());
+        std::ofstream ofs(filename, std::ios::binary | std::ios::trunc);
+        ofs.write((const char *) &header, sizeof(header));
+        ofs.seekp((long) header.data_offset);
+        std::vector<float> values(header.size), scales(header.size, 1);
+        std::vector<T> row(header.size);
+        for (int i = 0; i < lattice.size(); ++i) {
+            for (int j = 0; j < lattice.size(); ++j)
+                values[j] = (float) lattice(i, j);
+            if (header.data_type == INT8)
+                scales[i] = rowScale(values);
+            for (int j = 0; j < lattice.size(); ++j)
+                row[j] = narrow<T>(values[j], scales[i]);
+            ofs.write((const char *) row.data(), (long) (header.size * sizeof(T)));
+            header.checksum = checksum(header.checksum, row.data(), header.size * sizeof(T));
+        }
+        if (header.data_type == INT8) {
+            std::string padding(scaleOffset(header.size) - header.size * header.size, '\0');
+            ofs.write(padding.data(), (long) padding.size());
+            header.checksum = checksum(header.checksum, padding.data(), padding.size());
+            ofs.write((const char *) scales.data(), (long) (header.size * sizeof(float)));
+            header.checksum = checksum(header.checksum, scales.data(), header.size * sizeof(float));
+        }
+
+        // Rewrite header with the final checksum
+        ofs.seekp(0);
+        ofs.write((const char *) &header, sizeof(header));
+        if (not ofs.good())
+            throw std::runtime_error("Failed to write lattice file " + filename);
+    }
+}
+
+#endif //MARS_CI_LATTICEFILE_H
@@ -0,0 +1,282 @@
+#ifndef MARS_CI_METRICS_H
+#define MARS_CI_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+
+/**
+ * This namespace contains runtime counters of the program.
+ * Every thread updates counters of its own slot, so recording takes no locks and no atomic read-modify-write
+ * instructions; readers sum up all slots and may see values that are a few updates behind.
+ * Counters are only updated once per temperature level, job or write, never per spin.
+ * Slots of finished threads keep their values and are reused by new threads.
+ */
+namespace Metrics {
+    // Level sweep counts are bucketed by powers of two, the last bucket is open
+    constexpr int LEVEL_SWEEP_BUCKETS = 12;
+    // Sweeps are counted by temperature in bins of unit width, the last bin is open
+    constexpr int TEMPERATURE_BINS = 32;
+
+    /**
+     * Counter values.
+     */
+    struct Snapshot {
+        long levels = 0;                        // Finished temperature levels
+        long sweeps = 0;                        // Sweeps over all spins of a block
+        long spin_updates = 0;                  // Spin value computations
+        long probability_recalculations = 0;    // Full recalculations of link probability products
+        long annealing_ns = 0;                  // Time spent in temperature levels
+        long jobs = 0;                          // Thread pool jobs finished
+        long job_ns = 0;                        // Time spent in thread pool jobs
+        long idle_ns = 0;                       // Time thread pool workers waited for jobs
+        long written_bytes = 0;                 // Bytes written by the output thread
+        long write_ns = 0;                      // Time the output thread spent writing
+        long level_sweeps[LEVEL_SWEEP_BUCKETS] = {};
+        long temperature_sweeps[TEMPERATURE_BINS] = {};
+    };
+
+    /**
+     * Counters of a single thread. Slots are allocated separately and padded, so that counters of different
+     * threads never share a cache line.
+     */
+    struct Slot {
+        char front_padding[64];
+        std::atomic<long> levels{0}, sweeps{0}, spin_updates{0}, probability_recalculations{0}, annealing_ns{0},
+                jobs{0}, job_ns{0}, idle_ns{0}, written_bytes{0}, write_ns{0};
+        std::atomic<long> level_sweeps[LEVEL_SWEEP_BUCKETS] = {}, temperature_sweeps[TEMPERATURE_BINS] = {};
+        std::atomic<bool> in_use{true};
+        Slot *next = nullptr;
+        char back_padding[64];
+    };
+
+    /**
+     * Get the first slot of the slot list. Slots are pushed to the front and never removed.
+     */
+    inline std::atomic<Slot *> &slots() {
+        static std::atomic<Slot *> first_slot{nullptr};
+        return first_slot;
+    }
+
+    /**
+     * Take a free slot or create a new one.
+     * @return Slot pointer
+     */
+    inline Slot *acquireSlot() {
+        for (Slot *slot = slots().load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+            bool in_use = false;
+            if (slot->in_use.compare_exchange_strong(in_use, true))
+                return slot;
+        }
+        auto slot = new Slot;
+        slot->next = slots().load(std::memory_order_relaxed);
+        while (not slots().compare_exchange_weak(slot->next, slot, std::memory_order_release))
+            ;
+        return slot;
+    }
+
+    /**
+     * Get slot of the current thread. The slot is released when the thread exits.
+     * @return Slot reference
+     */
+    inline Slot &local() {
+        struct Owner {
+            Slot *slot = acquireSlot();
+
+            ~Owner() { slot->in_use = false; }
+        };
+        static thread_local Owner owner;
+        return *owner.slot;
+    }
+
+    /**
+     * Add value to a counter of the current thread's slot.
+     * @param counter Counter of the slot
+     * @param value Value to add
+     */
+    inline void add(std::atomic<long> &counter, long value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    /**
+     * Get nanoseconds elapsed since a time point.
+     * @param start Time point
+     * @return Elapsed nanoseconds
+     */
+    inline long since(std::chrono::steady_clock::time_point start) {
+        return (long) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+    /**
+     * Record a finished temperature level of a run.
+     * @param temperature Level temperature
+     * @param sweeps Quantity of sweeps the level took
+     * @param spin_updates Quantity of spin value computations during the level
+     */
+    inline void levelFinished(float temperature, int sweeps, long spin_updates) {
+        Slot &slot = local();
+        add(slot.levels, 1);
+        add(slot.sweeps, sweeps);
+        add(slot.spin_updates, spin_updates);
+        int bucket = 0;
+        while (bucket < LEVEL_SWEEP_BUCKETS - 1 and (1 << bucket) < sweeps)
+            bucket++;
+        add(slot.level_sweeps[bucket], 1);
+        int bin = temperature < 0 ? 0 : temperature >= TEMPERATURE_BINS ? TEMPERATURE_BINS - 1 : (int) temperature;
+        add(slot.temperature_sweeps[bin], sweeps);
+    }
+
+    /**
+     * Record time spent in a temperature level.
+     * @param nanoseconds Level time
+     */
+    inline void annealingTime(long nanoseconds) {
+        add(local().annealing_ns, nanoseconds);
+    }
+
+    /**
+     * Record a full recalculation of link probability products.
+     */
+    inline void probabilitiesRecalculated() {
+        add(local().probability_recalculations, 1);
+    }
+
+    /**
+     * Record a finished thread pool job.
+     * @param nanoseconds Job time
+     */
+    inline void jobFinished(long nanoseconds) {
+        Slot &slot = local();
+        add(slot.jobs, 1);
+        add(slot.job_ns, nanoseconds);
+    }
+
+    /**
+     * Record time a thread pool worker waited for jobs.
+     * @param nanoseconds Wait time
+     */
+    inline void idle(long nanoseconds) {
+        add(local().idle_ns, nanoseconds);
+    }
+
+    /**
+     * Record data written by the output thread.
+     * @param bytes Data length
+     * @param nanoseconds Write time
+     */
+    inline void written(long bytes, long nanoseconds) {
+        Slot &slot = local();
+        add(slot.written_bytes, bytes);
+        add(slot.write_ns, nanoseconds);
+    }
+
+    /**
+     * Sum up counters of all slots.
+     * @return Counter values
+     */
+    inline Snapshot collect() {
+        Snapshot snapshot;
+        auto load = [](const std::atomic<long> &counter) { return counter.load(std::memory_order_relaxed); };
+        for (Slot *slot = slots().load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+            snapshot.levels += load(slot->levels);
+            snapshot.sweeps += load(slot->sweeps);
+            snapshot.spin_updates += load(slot->spin_updates);
+            snapshot.probability_recalculations += load(slot->probability_recalculations);
+            snapshot.annealing_ns += load(slot->annealing_ns);
+            snapshot.jobs += load(slot->jobs);
+            snapshot.job_ns += load(slot->job_ns);
+            snapshot.idle_ns += load(slot->idle_ns);
+            snapshot.written_bytes += load(slot->written_bytes);
+            snapshot.write_ns += load(slot->write_ns);
+            for (int bucket = 0; bucket < LEVEL_SWEEP_BUCKETS; ++bucket)
+                snapshot.level_sweeps[bucket] += load(slot->level_sweeps[bucket]);
+            for (int bin = 0; bin < TEMPERATURE_BINS; ++bin)
+                snapshot.temperature_sweeps[bin] += load(slot->temperature_sweeps[bin]);
+        }
+        return snapshot;
+    }
+
+    /**
+     * Format counter values as a JSON object.
+     * @param snapshot Counter values
+     * @param uptime Seconds since the program start
+     * @param spin_update_rate Spin updates per second since the previous export
+     * @return JSON text
+     */
+    inline std::string toJson(const Snapshot &snapshot, double uptime, double spin_update_rate) {
+        std::ostringstream out;
+        out << "{\"uptime_s\": " << uptime << ", \"levels\": " << snapshot.levels << ", \"sweeps\": "
+            << snapshot.sweeps << ", \"spin_updates\": " << snapshot.spin_updates << ", \"spin_updates_per_s\": "
+            << spin_update_rate << ", \"probability_recalculations\": " << snapshot.probability_recalculations
+            << ", \"annealing_s\": " << (double) snapshot.annealing_ns * 1e-9 << ", \"jobs\": " << snapshot.jobs
+            << ", \"job_s\": " << (double) snapshot.job_ns * 1e-9 << ", \"idle_s\": "
+            << (double) snapshot.idle_ns * 1e-9 << ", \"written_bytes\": " << snapshot.written_bytes
+            << ", \"write_s\": " << (double) snapshot.write_ns * 1e-9 << ", \"level_sweeps\": {";
+        for (int bucket = 0; bucket < LEVEL_SWEEP_BUCKETS; ++bucket)
+            out << (bucket > 0 ? ", " : "") << "\""
+                << (bucket < LEVEL_SWEEP_BUCKETS - 1 ? std::to_string(1 << bucket) : "+Inf") << "\": "
+                << snapshot.level_sweeps[bucket];
+        out << "}, \"temperature_sweeps\": [";
+        for (int bin = 0; bin < TEMPERATURE_BINS; ++bin)
+            out << (bin > 0 ? ", " : "") << snapshot.temperature_sweeps[bin];
+        out << "]}" << std::endl;
+        return out.str();
+    }
+
+    /**
+     * Format counter values in Prometheus text exposition format.
+     * @param snapshot Counter values
+     * @param uptime Seconds since the program start
+     * @param spin_update_rate Spin updates per second since the previous export
+     * @return Metrics text
+     */
+    inline std::string toPrometheus(const Snapshot &snapshot, double uptime, double spin_update_rate) {
+        std::ostringstream out;
+        auto metric = [&out](const std::string &name, const std::string &type, const std::string &help,
+                             double value) {
+            out << "# HELP mars_ci_" << name << " " << help << "\n# TYPE mars_ci_" << name << " " << type << "\n"
+                << "mars_ci_" << name << " " << value << "\n";
+        };
+        metric("uptime_seconds", "gauge", "Seconds since the program start.", uptime);
+        metric("levels_total", "counter", "Finished temperature levels.", (double) snapshot.levels);
+        metric("sweeps_total", "counter", "Sweeps over all spins of a block.", (double) snapshot.sweeps);
+        metric("spin_updates_total", "counter", "Spin value computations.", (double) snapshot.spin_updates);
+        metric("spin_updates_per_second", "gauge", "Spin value computations per second since the previous export.",
+               spin_update_rate);
+        metric("probability_recalculations_total", "counter", "Full recalculations of link probability products.",
+               (double) snapshot.probability_recalculations);
+        metric("annealing_seconds_total", "counter", "Time spent in temperature levels.",
+               (double) snapshot.annealing_ns * 1e-9);
+        metric("jobs_total", "counter", "Thread pool jobs finished.", (double) snapshot.jobs);
+        metric("job_seconds_total", "counter", "Time spent in thread pool jobs.", (double) snapshot.job_ns * 1e-9);
+        metric("idle_seconds_total", "counter", "Time thread pool workers waited for jobs.",
+               (double) snapshot.idle_ns * 1e-9);
+        metric("written_bytes_total", "counter", "Bytes written by the output thread.",
+               (double) snapshot.written_bytes);
+        metric("write_seconds_total", "counter", "Time the output thread spent writing.",
+               (double) snapshot.write_ns * 1e-9);
+
+        out << "# HELP mars_ci_level_sweeps Sweeps a temperature level took to converge.\n"
+            << "# TYPE mars_ci_level_sweeps histogram\n";
+        long cumulative = 0;
+        for (int bucket = 0; bucket < LEVEL_SWEEP_BUCKETS; ++bucket) {
+            cumulative += snapshot.level_sweeps[bucket];
+            out << "mars_ci_level_sweeps_bucket{le=\""
+                << (bucket < LEVEL_SWEEP_BUCKETS - 1 ? std::to_string(1 << bucket) : "+Inf") << "\"} " << cumulative
+                << "\n";
+        }
+        out << "mars_ci_level_sweeps_sum " << snapshot.sweeps << "\nmars_ci_level_sweeps_count " << snapshot.levels
+            << "\n";
+
+        out << "# HELP mars_ci_temperature_sweeps_total Sweeps by temperature, in bins of unit width.\n"
+            << "# TYPE mars_ci_temperature_sweeps_total counter\n";
+        for (int bin = 0; bin < TEMPERATURE_BINS; ++bin)
+            out << "mars_ci_temperature_sweeps_total{temperature=\"" << bin
+                << (bin < TEMPERATURE_BINS - 1 ? "" : "+") << "\"} " << snapshot.temperature_sweeps[bin] << "\n";
+        return out.str();
+    }
+}
+
+#endif //MARS_CI_METRICS_H
@@ -0,0 +1,95 @@
+#ifndef MARS_CI_METRICSEXPORTER_H
+#define MARS_CI_METRICSEXPORTER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "AsyncWriter.h"
+#include "Metrics.h"
+
+/**
+ * Represents a thread that periodically replaces a file with current counter values.
+ * The file is written once more when the exporter is destroyed.
+ */
+class MetricsExporter {
+private:
+    AsyncWriter &writer;
+    std::string filename;
+    bool prometheus;
+    std::chrono::duration<double> interval;
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now(), last_time = start_time;
+    long last_spin_updates = 0;
+
+    std::mutex stop_mutex;
+    std::condition_variable stop_requested;
+    bool stopping = false;
+    std::thread exporter_thread;
+
+    /**
+     * Write current counter values.
+     */
+    void exportMetrics();
+
+    /**
+     * Main loop of the exporter thread.
+     */
+    void exporterLoop();
+
+public:
+    /**
+     * MetricsExporter constructor.
+     * @param writer Writer that replaces the file
+     * @param filename Metrics filename
+     * @param format json or prometheus
+     * @param interval Seconds between exports
+     */
+    MetricsExporter(AsyncWriter &writer, std::string filename, const std::string &format, double interval);
+
+    MetricsExporter(const MetricsExporter &) = delete;
+
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+    /**
+     * MetricsExporter destructor. Stops the exporter thread and writes final values.
+     */
+    ~MetricsExporter();
+};
+
+inline MetricsExporter::MetricsExporter(AsyncWriter &writer, std::string filename, const std::string &format,
+                                        double interval) :
+        writer(writer), filename(std::move(filename)), prometheus(format == "prometheus"), interval(interval) {
+    exporter_thread = std::thread(&MetricsExporter::exporterLoop, this);
+}
+
+inline MetricsExporter::~MetricsExporter() {
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex);
+        stopping = true;
+    }
+    stop_requested.notify_all();
+    exporter_thread.join();
+    exportMetrics();
+}
+
+inline void MetricsExporter::exportMetrics() {
+    Metrics::Snapshot snapshot = Metrics::collect();
+    auto now = std::chrono::steady_clock::now();
+    double uptime = std::chrono::duration<double>(now - start_time).count();
+    double elapsed = std::chrono::duration<double>(now - last_time).count();
+    double spin_update_rate = elapsed > 0 ? (double) (snapshot.spin_updates - last_spin_updates) / elapsed : 0;
+    last_time = now;
+    last_spin_updates = snapshot.spin_updates;
+    writer.replace(filename, prometheus ? Metrics::toPrometheus(snapshot, uptime, spin_update_rate) :
+                             Metrics::toJson(snapshot, uptime, spin_update_rate));
+}
+
+inline void MetricsExporter::exporterLoop() {
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    while (not stop_requested.wait_for(lock, interval, [this] { return stopping; }))
+        exportMetrics();
+}
+
+#endif //MARS_CI_METRICSEXPORTER_H
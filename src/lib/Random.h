@@ -5,29 +5,216 @@
 #ifndef MARS_CI_RANDOM_H
 #define MARS_CI_RANDOM_H
 
+#include <cstdint>
 #include <cstdlib>
 
 /**
  * This namespace contains all operations required to work with random numbers.
+ * Random values come from the Philox4x32-10 counter-based generator. Every stream is keyed by
+ * (seed, run index, stream index) and its values depend only on the key and position in the stream,
+ * so results do not depend on thread count or scheduling.
  */
 namespace Random {
+    /**
+     * Stream index reserved for random lattice generation.
+     */
+    constexpr uint32_t LATTICE_STREAM = 0xFFFFFFFF;
+
+    /**
+     * Stream index reserved for replica exchange decisions.
+     */
+    constexpr uint32_t EXCHANGE_STREAM = 0xFFFFFFFE;
+
+    /**
+     * Scale that maps a random 32-bit word to [0, 1).
+     */
+    constexpr double WORD_SCALE = 1. / 4294967296.;
+
+    /**
+     * Get global seed storage.
+     * @return Seed reference
+     */
+    inline uint64_t &globalSeed() {
+        static uint64_t seed = 0;
+        return seed;
+    }
+
     /**
      * Initialize random generator with specified seed.
+     * Streams created afterwards without an explicit seed use this one.
      * @param seed Seed value
      */
-    void init(uint seed) {
-        srand(seed);
+    inline void init(uint64_t seed) {
+        globalSeed() = seed;
+    }
+
+    /**
+     * Philox4x32-10 block function. Transforms a 128-bit counter with a 64-bit key.
+     * @param counter Counter words, replaced with the output words
+     * @param key Key words
+     */
+    inline void philox(uint32_t counter[4], const uint32_t key[2]) {
+        uint32_t k0 = key[0], k1 = key[1];
+        for (int round = 0; round < 10; ++round) {
+            uint64_t product_0 = (uint64_t) 0xD2511F53 * counter[0];
+            uint64_t product_1 = (uint64_t) 0xCD9E8D57 * counter[2];
+            uint32_t c0 = (uint32_t) (product_1 >> 32) ^ counter[1] ^ k0;
+            uint32_t c2 = (uint32_t) (product_0 >> 32) ^ counter[3] ^ k1;
+            counter[1] = (uint32_t) product_1;
+            counter[3] = (uint32_t) product_0;
+            counter[0] = c0;
+            counter[2] = c2;
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
     }
 
     /**
-     * Get uniformly distributed random value in specified bounds.
-     * @param min Lower bound
-     * @param max Upper bound
-     * @return Random value
+     * Represents an independent reproducible stream of random values.
      */
-    double uniform(double min, double max) {
-        return (max - min) * (double) std::rand() / (double) RAND_MAX + min;
-        // TODO(aryavorskiy): Implement another random generator
+    class Stream {
+    private:
+        uint32_t key[2]{};
+        uint32_t run_index = 0, stream_index = 0;
+        uint64_t position = 0;
+
+        // Output of the block containing current position
+        uint32_t buffer[4]{};
+        uint64_t buffered_block = UINT64_MAX;
+
+        /**
+         * Get random 32-bit word at specified position.
+         * @param word_position Position in the stream
+         * @return Random word
+         */
+        uint32_t word(uint64_t word_position);
+
+    public:
+        /**
+         * Stream constructor.
+         * @param seed Seed value
+         * @param run_index Index of the run that uses the stream
+         * @param stream_index Index of the stream inside the run
+         */
+        Stream(uint64_t seed, uint32_t run_index, uint32_t stream_index);
+
+        /**
+         * Stream constructor that uses the global seed.
+         * @param run_index Index of the run that uses the stream
+         * @param stream_index Index of the stream inside the run
+         */
+        Stream(uint32_t run_index, uint32_t stream_index);
+
+        /**
+         * Get uniformly distributed random value in specified bounds.
+         * @param min Lower bound
+         * @param max Upper bound
+         * @return Random value
+         */
+        double uniform(double min, double max);
+
+        /**
+         * Fill array with uniformly distributed random values in specified bounds.
+         * Produces the same values as consecutive uniform calls.
+         * @param values Array pointer
+         * @param count Value count
+         * @param min Lower bound
+         * @param max Upper bound
+         */
+        template<typename T>
+        void fill(T *values, long count, double min, double max);
+
+        /**
+         * Get count of values consumed from the stream.
+         * @return Stream position
+         */
+        uint64_t tell() const;
+
+        /**
+         * Move to specified position in the stream.
+         * @param position Stream position
+         */
+        void seek(uint64_t position);
+    };
+
+    Stream::Stream(uint64_t seed, uint32_t run_index, uint32_t stream_index) :
+            run_index(run_index), stream_index(stream_index) {
+        key[0] = (uint32_t) seed;
+        key[1] = (uint32_t) (seed >> 32);
+    }
+
+    Stream::Stream(uint32_t run_index, uint32_t stream_index) :
+            Stream(globalSeed(), run_index, stream_index) {}
+
+    uint32_t Stream::word(uint64_t word_position) {
+        uint64_t block = word_position / 4;
+        if (block != buffered_block) {
+            buffer[0] = (uint32_t) block;
+            buffer[1] = (uint32_t) (block >> 32);
+            buffer[2] = run_index;
+            buffer[3] = stream_index;
+            philox(buffer, key);
+            buffered_block = block;
+        }
+        return buffer[word_position % 4];
+    }
+
+    double Stream::uniform(double min, double max) {
+        return (max - min) * (word(position++) * WORD_SCALE) + min;
+    }
+
+    template<typename T>
+    void Stream::fill(T *values, long count, double min, double max) {
+        const int batch = 16;
+        long index = 0;
+        // Leading values up to a block boundary
+        for (; index < count and position % 4 != 0; ++index)
+            values[index] = (T) uniform(min, max);
+
+        // Whole batches of blocks are generated independently, which lets the compiler vectorize them
+        while (count - index >= 4 * batch) {
+            uint32_t words[4][batch];
+            uint64_t block = position / 4;
+            for (int lane = 0; lane < batch; ++lane) {
+                words[0][lane] = (uint32_t) (block + lane);
+                words[1][lane] = (uint32_t) ((block + lane) >> 32);
+                words[2][lane] = run_index;
+                words[3][lane] = stream_index;
+            }
+            uint32_t k0 = key[0], k1 = key[1];
+            for (int round = 0; round < 10; ++round) {
+                for (int lane = 0; lane < batch; ++lane) {
+                    uint64_t product_0 = (uint64_t) 0xD2511F53 * words[0][lane];
+                    uint64_t product_1 = (uint64_t) 0xCD9E8D57 * words[2][lane];
+                    uint32_t c0 = (uint32_t) (product_1 >> 32) ^ words[1][lane] ^ k0;
+                    uint32_t c2 = (uint32_t) (product_0 >> 32) ^ words[3][lane] ^ k1;
+                    words[1][lane] = (uint32_t) product_1;
+                    words[3][lane] = (uint32_t) product_0;
+                    words[0][lane] = c0;
+                    words[2][lane] = c2;
+                }
+                k0 += 0x9E3779B9;
+                k1 += 0xBB67AE85;
+            }
+            for (int lane = 0; lane < batch; ++lane)
+                for (int word_index = 0; word_index < 4; ++word_index)
+                    values[index + 4 * lane + word_index] =
+                            (T) ((max - min) * (words[word_index][lane] * WORD_SCALE) + min);
+            index += 4 * batch;
+            position += 4 * batch;
+        }
+
+        // Trailing values
+        for (; index < count; ++index)
+            values[index] = (T) uniform(min, max);
+    }
+
+    uint64_t Stream::tell() const {
+        return position;
+    }
+
+    void Stream::seek(uint64_t _position) {
+        position = _position;
     }
 }
 
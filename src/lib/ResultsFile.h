@@ -0,0 +1,179 @@
+#ifndef MARS_CI_RESULTSFILE_H
+#define MARS_CI_RESULTSFILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "LatticeFile.h"
+#include "Set.h"
+
+/**
+ * This namespace describes run results records and their text and binary formats.
+ * The text format is the one of the results file. A binary results file is a sequence of records, each one is
+ * a RecordHeader followed by set_count set entries: int32 set type, float64 Hamiltonian and set_size spin values
+ * of the record data type.
+ */
+namespace ResultsFile {
+    constexpr char MAGIC[4] = {'M', 'R', 'E', 'S'};
+    constexpr uint32_t VERSION = 1;
+
+    /**
+     * Record kinds.
+     */
+    enum RecordKind : uint32_t {
+        STARTED = 1,    // Block state before annealing
+        FINISHED = 2    // Block state after annealing
+    };
+
+    struct RecordHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t length;        // Byte length of the set entries that follow the header
+        uint32_t kind;
+        float start_temp;
+        float temperature;
+        int32_t step_counter;
+        int32_t set_count;
+        int32_t set_size;
+        uint32_t data_type;     // LatticeFile::DataType of spin values
+    };
+
+    struct SetData {
+        int32_t set_type;
+        double hamiltonian;
+        std::vector<double> values;
+    };
+
+    struct Record {
+        uint32_t kind;
+        float start_temp, temperature;
+        int step_counter;
+        uint32_t data_type;
+        std::vector<SetData> sets;
+    };
+
+    /**
+     * Encode record in binary format.
+     * @param record Record
+     * @return Binary record
+     */
+    inline std::string toBinary(const Record &record) {
+        int set_size = record.sets.empty() ? 0 : (int) record.sets[0].values.size();
+        uint64_t element_size = LatticeFile::elementSize(record.data_type);
+        RecordHeader header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.length = (uint32_t) (record.sets.size() * (sizeof(int32_t) + sizeof(double) + set_size * element_size));
+        header.kind = record.kind;
+        header.start_temp = record.start_temp;
+        header.temperature = record.temperature;
+        header.step_counter = record.step_counter;
+        header.set_count = (int32_t) record.sets.size();
+        header.set_size = set_size;
+        header.data_type = record.data_type;
+
+        std::string data((const char *) &header, sizeof(header));
+        for (const SetData &set : record.sets) {
+            data.append((const char *) &set.set_type, sizeof(set.set_type));
+            data.append((const char *) &set.hamiltonian, sizeof(set.hamiltonian));
+            for (double value : set.values) {
+                if (record.data_type == LatticeFile::FLOAT32) {
+                    auto float_value = (float) value;
+                    data.append((const char *) &float_value, sizeof(float_value));
+                } else {
+                    data.append((const char *) &value, sizeof(value));
+                }
+            }
+        }
+        return data;
+    }
+
+    /**
+     * Read a binary record.
+     * @param ifs Binary results stream
+     * @param record Record to store data in
+     * @return False if the stream has ended
+     */
+    inline bool readBinary(std::istream &ifs, Record &record) {
+        RecordHeader header{};
+        ifs.read((char *) &header, sizeof(header));
+        if (ifs.gcount() == 0)
+            return false;
+        if (ifs.gcount() != sizeof(header) or std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+            throw std::runtime_error("Corrupt results record");
+        if (header.version != VERSION)
+            throw std::runtime_error("Unsupported results record version " + std::to_string(header.version));
+        uint64_t element_size = LatticeFile::elementSize(header.data_type);
+        uint64_t set_length = sizeof(int32_t) + sizeof(double) + header.set_size * element_size;
+        if (header.set_count < 0 or header.set_size < 0 or header.length != header.set_count * set_length)
+            throw std::runtime_error("Corrupt results record");
+
+        record.kind = header.kind;
+        record.start_temp = header.start_temp;
+        record.temperature = header.temperature;
+        record.step_counter = header.step_counter;
+        record.data_type = header.data_type;
+        record.sets.assign(header.set_count, SetData{});
+        for (SetData &set : record.sets) {
+            ifs.read((char *) &set.set_type, sizeof(set.set_type));
+            ifs.read((char *) &set.hamiltonian, sizeof(set.hamiltonian));
+            set.values.resize(header.set_size);
+            for (double &value : set.values) {
+                if (header.data_type == LatticeFile::FLOAT32) {
+                    float float_value = 0;
+                    ifs.read((char *) &float_value, sizeof(float_value));
+                    value = float_value;
+                } else {
+                    ifs.read((char *) &value, sizeof(value));
+                }
+            }
+        }
+        if (not ifs.good())
+            throw std::runtime_error("Truncated results record");
+        return true;
+    }
+
+    /**
+     * Format record in text results file format.
+     * @param record Record
+     * @return Text record
+     */
+    inline std::string toText(const Record &record) {
+        std::ostringstream out;
+        if (record.kind == STARTED)
+            out << "Started processing block from temperature " << record.temperature << ":" << std::endl;
+        else
+            out << "Finished processing block; Start temperature was " << record.start_temp << "; Took "
+                << record.step_counter << " steps; Block data:" << std::endl;
+        for (unsigned int set_index = 0; set_index < record.sets.size(); ++set_index) {
+            const SetData &set = record.sets[set_index];
+            out << "Set #" << set_index << "; ";
+            switch (set.set_type) {
+                case INDEPENDENT:
+                    out << "Type: Independent; ";
+                    break;
+                case DEPENDENT:
+                    out << "Type: Dependent; ";
+                    break;
+                case NO_ANNEAL:
+                    out << "Type: No_anneal; ";
+                    break;
+                default:
+                    break;
+            }
+            out << "Hamiltonian: " << set.hamiltonian << "; Data:" << std::endl;
+            for (double value : set.values)
+                out << value << " ";
+            out << std::endl;
+        }
+        out << std::endl;
+        return out.str();
+    }
+}
+
+#endif //MARS_CI_RESULTSFILE_H
@@ -5,9 +5,15 @@
 #ifndef MARS_CI_SET_H
 #define MARS_CI_SET_H
 
-#define FORMULA_SYM
+#include <cassert>
+#include <cmath>
+#include <utility>
+#include <vector>
 
+#include "BigFloat.h"
+#include "Formula.h"
 #include "Lattice.h"
+#include "Metrics.h"
 
 enum SetType {
     INDEPENDENT,    // Does not interact with other sets
@@ -23,16 +29,68 @@ enum SetType {
  */
 template<typename T>
 class Set {
-    typedef std::shared_ptr<Set<T>> LinkedSet;
 private:
-    static constexpr T delta = 0.01;
+    static constexpr T field_tolerance = 1e-5;
 
     int set_size = 0;
     T *set_values = nullptr;
-    std::vector<LinkedSet> linked_sets{};
+
+    /**
+     * Sets of the block this set belongs to. Links are indices of the linked sets in it, neither owns the sets.
+     */
+    Set<T> *block_sets = nullptr;
+    int set_index = 0;
+    std::vector<int> linked_sets{};
+
+    /**
+     * Spin-major mirror of the block spin values: spin i of set s is stored at spin_columns[i * column_stride + s],
+     * so values of a spin in all linked sets share a cache line. Updated by setSpin and writeSpin.
+     */
+    T *spin_columns = nullptr;
+    int column_stride = 0;
+
+    /**
+     * Equality probability products of every link. A product of spin factors (1 +- a_i * b_i) / 2 is stored as
+     * the quantity of zero factors and the product of the non-zero ones, so a factor can be replaced in O(1)
+     * even if it is zero. BigFloat keeps a binary exponent, so the products do not underflow.
+     */
     std::vector<BigFloat> probabilities{}, inv_probabilities{};
+    std::vector<int> zero_factors{}, inv_zero_factors{};
+
+    /**
+     * Indices of sets that link to this one and indices of the links in them.
+     */
+    std::vector<std::pair<int, int>> back_links{};
+
+    /**
+     * Local field cache. local_fields[j] holds sum of field_values[i] * lattice(i, j) over i != j,
+     * field_values holds spin values the cache was last updated with.
+     */
+    const Lattice<T> *field_lattice = nullptr;
+    std::vector<double> local_fields{};
+    std::vector<T> field_values{};
 
-    BigFloat interactionMeanField(int spin_index, BigFloat interaction_multiplier);
+    /**
+     * Hamiltonian of field_values, updated together with the local field cache.
+     */
+    double field_energy = 0;
+
+    template<typename F>
+    BigFloat interactionMeanField(int spin_index, const BigFloat &interaction_multiplier);
+
+    /**
+     * Replace a spin factor of the link probability products.
+     * @param link_index Link index
+     * @param old_product Product of the linked spin values the factor was computed for
+     * @param new_product Product of the new linked spin values
+     */
+    void replaceFactor(int link_index, double old_product, double new_product);
+
+    /**
+     * Propagate the difference between stored and cached spin value to the local field cache.
+     * @param index Spin index
+     */
+    void updateLocalFields(int index);
 
 public:
     SetType set_type = EMPTY;
@@ -45,16 +103,34 @@ public:
     /**
      * Set constructor.
      * @param size Spin quantity
-     * @param set_values Spin value array pointer
+     * @param set_values Spin value array pointer, not owned by the set
      * @param set_type Type of set (see SetType docs)
+     * @param block_sets Array of sets of the block this set belongs to, not owned by the set
+     * @param set_index Index of this set in the block
+     * @param spin_columns Spin-major value array of the block, not owned by the set
+     * @param column_stride Distance between values of neighbouring spins in spin_columns
      */
-    Set(int size, T *set_values, SetType set_type);
+    Set(int size, T *set_values, SetType set_type, Set<T> *block_sets, int set_index, T *spin_columns,
+        int column_stride);
 
     /**
-     * Create a one-directional link to another Set object.
-     * @param linked_set Set object to link to
+     * Create a one-directional link to another set of the same block.
+     * @param linked_index Index of the set to link to
      */
-    void createLink(Set<T> &linked_set);
+    void createLink(int linked_index);
+
+    /**
+     * Enable local field caching for specified lattice and compute all local field values.
+     * Mean field queries with this lattice will read the cache instead of recomputing the sum.
+     * @param lattice Lattice describing spin interactions
+     */
+    void bindLattice(const Lattice<T> &lattice);
+
+    /**
+     * Disable local field caching. Must be called before spins are written with writeSpin if a lattice is bound,
+     * since writeSpin does not update the cache.
+     */
+    void unbindLattice();
 
     /**
     * Get spin from specified index.
@@ -71,24 +147,57 @@ public:
     void setSpin(int index, T value);
 
     /**
-     * Recalculate all stored equality probability values.
-     * Call every time before performing a sweep on all spins
+     * Set spin at specified index without updating stored probability values and the local field cache.
+     * Spins at different indices may be written concurrently; probabilities are valid again after
+     * recalculateProbabilities is called.
+     * @param index Spin index
+     * @param value Spin value
+     */
+    void writeSpin(int index, T value);
+
+    /**
+     * Recalculate stored equality probability values from scratch.
+     * Stored values are kept up to date by setSpin, so only call this after spins were written bypassing it.
+     * @param link_index Link index
      */
     void recalculateProbabilities(int link_index);
 
     /**
      * Calculates mean field value for specified spin.
+     * @tparam F Interaction formula policy (see Formula.h)
      * @param lattice Lattice describing spin interactions
      * @return Mean field value
      */
-    BigFloat meanField(int spin_index, Lattice<T> lattice, BigFloat interaction_multiplier);
+    template<typename F = SymmetricFormula>
+    BigFloat meanField(int spin_index, const Lattice<T> &lattice, const BigFloat &interaction_multiplier);
+
+    /**
+     * Calculates mean field value for specified spin from a precomputed in-set local field.
+     * @tparam F Interaction formula policy (see Formula.h)
+     * @param spin_index Spin index
+     * @param local_field Sum of spin values multiplied by their lattice elements
+     * @return Mean field value
+     */
+    template<typename F = SymmetricFormula>
+    BigFloat meanField(int spin_index, double local_field, const BigFloat &interaction_multiplier);
 
     /**
      * Calculate hamiltonian of spin system.
      * @param lattice Lattice describing spin interactions
      * @return Hamiltonian value
      */
-    T hamiltonian(Lattice<T> lattice);
+    T hamiltonian(const Lattice<T> &lattice);
+
+    /**
+     * Get hamiltonian of spin system without a pass over the lattice if the local field cache is bound to it.
+     * The energy is tracked as the cache is updated; changes that are still pending are added to the first
+     * order with a single pass over the spins. Otherwise the hamiltonian is calculated.
+     * If ENERGY_CHECK is defined (CMake option MARS_CI_ENERGY_CHECK), the tracked energy is asserted to match
+     * the calculated hamiltonian, which costs a lattice pass per call.
+     * @param lattice Lattice describing spin interactions
+     * @return Hamiltonian value
+     */
+    T energy(const Lattice<T> &lattice);
 
     /**
      * Get spin count in set.
@@ -104,17 +213,58 @@ public:
 };
 
 template<typename T>
-Set<T>::Set(int _size, T *_set_values, SetType _set_type) {
+Set<T>::Set(int _size, T *_set_values, SetType _set_type, Set<T> *_block_sets, int _set_index, T *_spin_columns,
+            int _column_stride) {
     set_size = _size;
     set_values = _set_values;
     set_type = _set_type;
+    block_sets = _block_sets;
+    set_index = _set_index;
+    spin_columns = _spin_columns;
+    column_stride = _column_stride;
 }
 
 template<typename T>
-void Set<T>::createLink(Set<T> &linked_set) {
-    linked_sets.emplace_back(&linked_set);
+void Set<T>::createLink(int linked_index) {
+    linked_sets.push_back(linked_index);
     probabilities.push_back(BigFloat{1});
     inv_probabilities.push_back(BigFloat{1});
+    zero_factors.push_back(0);
+    inv_zero_factors.push_back(0);
+    block_sets[linked_index].back_links.emplace_back(set_index, (int) linked_sets.size() - 1);
+}
+
+template<typename T>
+void Set<T>::bindLattice(const Lattice<T> &lattice) {
+    field_lattice = &lattice;
+    field_values.assign(set_values, set_values + set_size);
+    local_fields.resize(set_size);
+    // Lattice is symmetric, so the column sum equals the row sum
+    field_energy = 0;
+    for (int j = 0; j < set_size; ++j) {
+        local_fields[j] = lattice.dot(j, set_values) - (double) set_values[j] * lattice(j, j);
+        field_energy += 0.5 * set_values[j] * local_fields[j];
+    }
+}
+
+template<typename T>
+void Set<T>::unbindLattice() {
+    field_lattice = nullptr;
+    local_fields.clear();
+    field_values.clear();
+}
+
+template<typename T>
+void Set<T>::updateLocalFields(int index) {
+    double value_change = set_values[index] - field_values[index];
+    if (std::fabs(value_change) < field_tolerance)
+        // Negligible change - keep it pending until it accumulates
+        return;
+    // Local field of the spin does not depend on its own value
+    field_energy += value_change * local_fields[index];
+    field_lattice->axpy(index, value_change, local_fields.data());
+    local_fields[index] -= value_change * (*field_lattice)(index, index);
+    field_values[index] = set_values[index];
 }
 
 template<typename T>
@@ -126,95 +276,147 @@ template<typename T>
 void Set<T>::setSpin(int index, T value) {
     if (value == set_values[index])
         return;
+    // Linked values are read from the spin-major mirror, a single cache line for small blocks
+    T *column = spin_columns + (long) index * column_stride;
     for (unsigned int link_index = 0; link_index < linked_sets.size(); ++link_index) {
-        if (std::fabs(value) == 1 and std::fabs(set_values[index]) == 1) {
-            // Prevent zero division
-            recalculateProbabilities(link_index);
-            continue;
-        }
-        if (probabilities[link_index] != 0)
-            probabilities[link_index] *=
-                    (1 + (*linked_sets[link_index])[index] * value) /
-                    (1 + (*linked_sets[link_index])[index] * set_values[index]);
-        if (inv_probabilities[link_index] != 0)
-            inv_probabilities[link_index] *=
-                    (1 - (*linked_sets[link_index])[index] * value) /
-                    (1 - (*linked_sets[link_index])[index] * set_values[index]);
+        double linked_value = column[linked_sets[link_index]];
+        replaceFactor(link_index, linked_value * set_values[index], linked_value * value);
     }
+    // Products of the sets linked to this one contain the same factors
+    for (const std::pair<int, int> &back_link : back_links) {
+        double linking_value = column[back_link.first];
+        block_sets[back_link.first].replaceFactor(back_link.second, linking_value * set_values[index],
+                                                  linking_value * value);
+    }
+    set_values[index] = value;
+    column[set_index] = value;
+    if (field_lattice != nullptr)
+        updateLocalFields(index);
+}
+
+template<typename T>
+void Set<T>::replaceFactor(int link_index, double old_product, double new_product) {
+    double old_factor = (1 + old_product) / 2., new_factor = (1 + new_product) / 2.;
+    if (old_factor == 0)
+        zero_factors[link_index]--;
+    if (new_factor == 0)
+        zero_factors[link_index]++;
+    if (old_factor != 0 and new_factor != 0)
+        probabilities[link_index] *= new_factor / old_factor;
+    else if (old_factor != 0)
+        probabilities[link_index] /= old_factor;
+    else if (new_factor != 0)
+        probabilities[link_index] *= new_factor;
+
+    double old_inv_factor = (1 - old_product) / 2., new_inv_factor = (1 - new_product) / 2.;
+    if (old_inv_factor == 0)
+        inv_zero_factors[link_index]--;
+    if (new_inv_factor == 0)
+        inv_zero_factors[link_index]++;
+    if (old_inv_factor != 0 and new_inv_factor != 0)
+        inv_probabilities[link_index] *= new_inv_factor / old_inv_factor;
+    else if (old_inv_factor != 0)
+        inv_probabilities[link_index] /= old_inv_factor;
+    else if (new_inv_factor != 0)
+        inv_probabilities[link_index] *= new_inv_factor;
+}
+
+template<typename T>
+void Set<T>::writeSpin(int index, T value) {
     set_values[index] = value;
+    spin_columns[(long) index * column_stride + set_index] = value;
 }
 
 template<typename T>
 void Set<T>::recalculateProbabilities(int link_index) {
     BigFloat prob{1}, inv_prob{1};
+    int zero_count = 0, inv_zero_count = 0;
     for (int spin_index = 0; spin_index < set_size; ++spin_index) {
-        prob *= (1 + (*linked_sets[link_index])[spin_index] * set_values[spin_index]) / 2.;
-        inv_prob *= (1 - (*linked_sets[link_index])[spin_index] * set_values[spin_index]) / 2;
+        // Factors are computed in double in all places, so a removed factor equals the one added before
+        double product = (double) block_sets[linked_sets[link_index]][spin_index] * set_values[spin_index];
+        double factor = (1 + product) / 2., inv_factor = (1 - product) / 2.;
+        if (factor == 0)
+            zero_count++;
+        else
+            prob *= factor;
+        if (inv_factor == 0)
+            inv_zero_count++;
+        else
+            inv_prob *= inv_factor;
     }
     probabilities[link_index] = prob;
     inv_probabilities[link_index] = inv_prob;
-
+    zero_factors[link_index] = zero_count;
+    inv_zero_factors[link_index] = inv_zero_count;
+    Metrics::probabilitiesRecalculated();
 }
 
 template<typename T>
-BigFloat Set<T>::interactionMeanField(int spin_index, BigFloat interaction_multiplier) {
+template<typename F>
+BigFloat Set<T>::interactionMeanField(int spin_index, const BigFloat &interaction_multiplier) {
     BigFloat interaction_mean_field{0};
-#ifdef FORMULA_SYM
+    BigFloat half_multiplier = interaction_multiplier * 0.5;
+    T spin_value = set_values[spin_index];
+    const T *column = spin_columns + (long) spin_index * column_stride;
     for (unsigned int link_index = 0; link_index < linked_sets.size(); ++link_index) {
-        if (std::fabs((*linked_sets[link_index])[spin_index]) == 1)
+        T linked_value = column[linked_sets[link_index]];
+        if (std::fabs(linked_value) == 1)
             // Linked set spin is \pm 1 - continue
             continue;
-        interaction_mean_field += interaction_multiplier * 0.5 * (
-                (probabilities[link_index] * (1 + (*linked_sets[link_index])[spin_index]) /
-                 (1 + (*linked_sets[link_index])[spin_index] * set_values[spin_index]) +
-                 inv_probabilities[link_index] * (1 - (*linked_sets[link_index])[spin_index]) /
-                 (1 - (*linked_sets[link_index])[spin_index] * set_values[spin_index]) + delta)
-                /  //-----------------------------------------------------------------------
-                (probabilities[link_index] * (1 - (*linked_sets[link_index])[spin_index]) /
-                 (1 + (*linked_sets[link_index])[spin_index] * set_values[spin_index]) +
-                 inv_probabilities[link_index] * (1 + (*linked_sets[link_index])[spin_index]) /
-                 (1 - (*linked_sets[link_index])[spin_index] * set_values[spin_index]) + delta)
-        ).log();
-    }
-#endif
-
-#ifdef FORMULA_ASYM
-    for (unsigned int link_index = 0; link_index < linked_sets.size(); ++link_index) {
-        if (std::fabs((*linked_sets[link_index])[spin_index]) == 1)
-            // Linked set spin is \pm 1 - continue
-            continue;
-        interaction_mean_field += interaction_multiplier * 0.5 * BigFloat{
-                (1 + (*linked_sets[link_index])[spin_index]) / (1 - (*linked_sets[link_index])[spin_index])
-        }.log();
+        BigFloat probability{0}, inv_probability{0};
+        if (F::uses_probabilities) {
+            if (zero_factors[link_index] == 0)
+                probability = probabilities[link_index];
+            if (inv_zero_factors[link_index] == 0)
+                inv_probability = inv_probabilities[link_index];
+        }
+        interaction_mean_field += half_multiplier * F::logRatio(linked_value, spin_value, probability, inv_probability);
     }
-#endif
     return interaction_mean_field;
 }
 
 template<typename T>
-BigFloat Set<T>::meanField(int spin_index, Lattice<T> lattice, BigFloat interaction_multiplier) {
+template<typename F>
+BigFloat Set<T>::meanField(int spin_index, const Lattice<T> &lattice, const BigFloat &interaction_multiplier) {
     BigFloat interaction_mean_field =
-            interaction_multiplier == 0 ? 0 : interactionMeanField(spin_index, interaction_multiplier);
+            interaction_multiplier == 0 ? 0 : interactionMeanField<F>(spin_index, interaction_multiplier);
+    if (field_lattice == &lattice)
+        return interaction_mean_field + BigFloat(local_fields[spin_index]);
 
     // Calculate spin interaction in set
-    double spin_mean_field = 0;
-    for (int i = 0; i < set_size; ++i) {
-        if (i != spin_index)
-            spin_mean_field += set_values[i] * lattice(i, spin_index);
-    }
+    double spin_mean_field =
+            lattice.dot(spin_index, set_values) - (double) set_values[spin_index] * lattice(spin_index, spin_index);
     return interaction_mean_field + BigFloat(spin_mean_field);
 }
 
 template<typename T>
-T Set<T>::hamiltonian(Lattice<T> lattice) {
-    T ham = 0;
+template<typename F>
+BigFloat Set<T>::meanField(int spin_index, double local_field, const BigFloat &interaction_multiplier) {
+    if (interaction_multiplier == 0)
+        return BigFloat(local_field);
+    return interactionMeanField<F>(spin_index, interaction_multiplier) + BigFloat(local_field);
+}
+
+template<typename T>
+T Set<T>::hamiltonian(const Lattice<T> &lattice) {
+    double ham = 0;
     for (int i = 0; i < set_size; ++i)
-        for (int j = i + 1; j < set_size; ++j)
-            if (i == j)
-                ham += lattice(i, j) * set_values[i];
-            else
-                ham += lattice(i, j) * set_values[i] * set_values[j];
-    return ham;
+        ham += set_values[i] * lattice.dot(i, set_values, i + 1);
+    return (T) ham;
+}
+
+template<typename T>
+T Set<T>::energy(const Lattice<T> &lattice) {
+    if (field_lattice != &lattice)
+        return hamiltonian(lattice);
+    double energy = field_energy;
+    for (int i = 0; i < set_size; ++i)
+        energy += (set_values[i] - field_values[i]) * local_fields[i];
+#ifdef ENERGY_CHECK
+    double exact = hamiltonian(lattice);
+    assert(std::fabs(energy - exact) <= 1e-4 * (1 + std::fabs(exact)));
+#endif
+    return (T) energy;
 }
 
 template<typename T>
@@ -0,0 +1,185 @@
+#ifndef MARS_CI_THREADPOOL_H
+#define MARS_CI_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Metrics.h"
+
+/**
+ * Represents a fixed set of worker threads that execute submitted jobs.
+ * Every worker owns a job deque; idle workers steal jobs from the other deques.
+ */
+class ThreadPool {
+public:
+    typedef std::function<void()> Job;
+
+private:
+    struct JobQueue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<JobQueue>> queues{};
+    std::vector<std::thread> workers{};
+
+    std::mutex state_mutex;
+    std::condition_variable job_available, jobs_finished;
+    std::atomic<long> queued_jobs{0};
+    long unfinished_jobs = 0;
+    bool stopping = false;
+    std::atomic<unsigned> next_queue{0};
+
+    /**
+     * Index of the worker running on the current thread, -1 for foreign threads.
+     */
+    static int &currentWorker() {
+        static thread_local int worker_index = -1;
+        return worker_index;
+    }
+
+    /**
+     * Take a job from own deque or steal it from another worker.
+     * @param worker_index Index of the worker looking for a job
+     * @param job Variable to write the job to
+     * @return True if a job was found
+     */
+    bool takeJob(int worker_index, Job &job);
+
+    /**
+     * Main loop of a worker thread.
+     * @param worker_index Index of the worker
+     */
+    void workerLoop(int worker_index);
+
+public:
+    /**
+     * ThreadPool constructor.
+     * @param worker_count Quantity of worker threads
+     */
+    explicit ThreadPool(int worker_count);
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * ThreadPool destructor. Waits for all submitted jobs and stops the workers.
+     */
+    ~ThreadPool();
+
+    /**
+     * Submit a job for execution.
+     * Jobs submitted from a worker thread go to its own deque, others are distributed round-robin.
+     * @param job Job to execute
+     */
+    void submit(Job job);
+
+    /**
+     * Block until all submitted jobs are finished.
+     */
+    void wait();
+
+    /**
+     * Get worker thread count.
+     * @return Worker count
+     */
+    int size();
+};
+
+ThreadPool::ThreadPool(int worker_count) {
+    if (worker_count < 1)
+        worker_count = 1;
+    for (int worker_index = 0; worker_index < worker_count; ++worker_index)
+        queues.emplace_back(new JobQueue);
+    for (int worker_index = 0; worker_index < worker_count; ++worker_index)
+        workers.emplace_back(&ThreadPool::workerLoop, this, worker_index);
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        stopping = true;
+    }
+    job_available.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::submit(Job job) {
+    int worker_index = currentWorker();
+    if (worker_index < 0)
+        worker_index = (int) (next_queue++ % queues.size());
+    // Counted before it is pushed, as a worker may take and finish the job right away
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        unfinished_jobs++;
+        queued_jobs++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[worker_index]->mutex);
+        queues[worker_index]->jobs.push_back(std::move(job));
+    }
+    job_available.notify_one();
+}
+
+bool ThreadPool::takeJob(int worker_index, Job &job) {
+    // Own jobs are taken in submission order, stolen ones from the back of the victim's deque
+    for (unsigned offset = 0; offset < queues.size(); ++offset) {
+        JobQueue &queue = *queues[(worker_index + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty())
+            continue;
+        if (offset == 0) {
+            job = std::move(queue.jobs.front());
+            queue.jobs.pop_front();
+        } else {
+            job = std::move(queue.jobs.back());
+            queue.jobs.pop_back();
+        }
+        queued_jobs--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(int worker_index) {
+    currentWorker() = worker_index;
+    Job job;
+    while (true) {
+        if (takeJob(worker_index, job)) {
+            auto job_start = std::chrono::steady_clock::now();
+            job();
+            job = nullptr;
+            Metrics::jobFinished(Metrics::since(job_start));
+            std::lock_guard<std::mutex> lock(state_mutex);
+            if (--unfinished_jobs == 0)
+                jobs_finished.notify_all();
+            continue;
+        }
+        auto idle_start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(state_mutex);
+        job_available.wait(lock, [this] { return stopping or queued_jobs > 0; });
+        Metrics::idle(Metrics::since(idle_start));
+        if (stopping and queued_jobs == 0)
+            return;
+    }
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    jobs_finished.wait(lock, [this] { return unfinished_jobs == 0; });
+}
+
+int ThreadPool::size() {
+    return (int) workers.size();
+}
+
+#endif //MARS_CI_THREADPOOL_H
@@ -1,13 +1,31 @@
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
-#include <thread>
+#include <memory>
 #include <mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
-#include <semaphore.h>
 
+#include <sys/stat.h>
+
+#include "lib/AsyncWriter.h"
 #include "lib/BigFloat.h"
 #include "lib/Lattice.h"
+#include "lib/MetricsExporter.h"
+#include "lib/ResultsFile.h"
+#include "lib/ThreadPool.h"
 #include "BlockTemplate.h"
 #include "AnnealingRun.h"
+#include "Checkpoint.h"
+#include "Options.h"
+#include "Portfolio.h"
+#include "ReplicaBatch.h"
+#include "ReplicaExchange.h"
+#include "Server.h"
+#include "Session.h"
+#include "Shards.h"
+#include "SweepTeam.h"
 
 #define VERSION "3.4"
 #define BUILD 17
@@ -20,34 +38,16 @@
  * Block - several sets which descend simultaneously and interact with each other
  */
 
-std::mutex stdout_mutex, file_mutex;
+AsyncWriter output_writer;
 
-sem_t semaphore;
-
-template<typename T>
-std::ostream &operator<<(std::ostream &out, AnnealingRun<T> run) {
-    for (int set_index = 0; set_index < run.block.set_count; ++set_index) {
-        out << "Set #" << set_index << "; ";
-        switch (run.block[set_index].set_type) {
-            case INDEPENDENT:
-                out << "Type: Independent; ";
-                break;
-            case DEPENDENT:
-                out << "Type: Dependent; ";
-                break;
-            case NO_ANNEAL:
-                out << "Type: No_anneal; ";
-                break;
-            default:
-                break;
-        }
-        out << "Hamiltonian: " << run.block[set_index].hamiltonian(run.lattice) << "; Data:" << std::endl;
-        for (int spin_index = 0; spin_index < run.block.setSize(); ++spin_index)
-            out << run.block[set_index][spin_index] << " ";
-        out << std::endl;
-    }
-    return out;
-}
+/*
+ * Identifies a run of a session
+ */
+struct RunInfo {
+    int run_index;
+    float start_temp;
+    bool resumed;   // Run state was restored from a checkpoint
+};
 
 template<typename T>
 std::ostream &operator<<(std::ostream &out, Lattice<T> lattice) {
@@ -61,164 +61,548 @@ std::ostream &operator<<(std::ostream &out, Lattice<T> lattice) {
 }
 
 template<typename T>
-void anneal_output_silent(AnnealingRun<T> run) {
-    float start_temp = run.temperature;
-    sem_wait(&semaphore);
-    run.anneal();
-    sem_post(&semaphore);
-    stdout_mutex.lock();
-    std::cout << start_temp;
+ResultsFile::Record make_record(AnnealingRun<T> &run, ResultsFile::RecordKind kind, float start_temp) {
+    ResultsFile::Record record{kind, start_temp, run.temperature, run.step_counter, LatticeFile::dataType<T>(), {}};
     for (int set_index = 0; set_index < run.block.set_count; ++set_index) {
-        switch (run[set_index].set_type) {
+        ResultsFile::SetData set{run[set_index].set_type, run[set_index].energy(run.lattice), {}};
+        for (int spin_index = 0; spin_index < run.block.setSize(); ++spin_index)
+            set.values.push_back(run[set_index][spin_index]);
+        record.sets.push_back(set);
+    }
+    return record;
+}
+
+void output_summary(const ResultsFile::Record &record, const Server::LineWriter &write_line) {
+    std::ostringstream out;
+    out << record.start_temp;
+    for (const ResultsFile::SetData &set : record.sets) {
+        switch (set.set_type) {
             case INDEPENDENT:
-                std::cout << " <" << run[set_index].hamiltonian(run.lattice) << ">";
+                out << " <" << set.hamiltonian << ">";
                 break;
             case NO_ANNEAL:
-                std::cout << " (" << run[set_index].hamiltonian(run.lattice) << ")";
+                out << " (" << set.hamiltonian << ")";
                 break;
             default:
-                std::cout << " " << run[set_index].hamiltonian(run.lattice);
+                out << " " << set.hamiltonian;
                 break;
         }
     }
-    std::cout << std::endl;
-    stdout_mutex.unlock();
+    write_line(out.str());
+}
+
+void output_record(const ResultsFile::Record &record, const Session &session) {
+    if (session.results_filename == "NONE")
+        return;
+    output_writer.write(session.results_filename,
+                        session.results_binary ? ResultsFile::toBinary(record) : ResultsFile::toText(record));
+}
+
+template<typename T>
+void output_checkpoint(AnnealingRun<T> &run, const RunInfo &info, const Session &session, Checkpoint::Status status) {
+    uint64_t run_key = session.runKey();
+    output_writer.replace(Checkpoint::filename(session.checkpoint_dir, run_key, info.run_index),
+                          Checkpoint::encode(run, run_key, info.run_index, info.start_temp, status));
+}
+
+template<typename T>
+double best_energy(AnnealingRun<T> &run) {
+    double energy = 0;
+    bool found = false;
+    for (int set_index = 0; set_index < run.block.set_count; ++set_index) {
+        if (run[set_index].set_type == NO_ANNEAL)
+            continue;
+        double set_energy = run[set_index].energy(run.lattice);
+        energy = found ? std::min(energy, set_energy) : set_energy;
+        found = true;
+    }
+    return energy;
 }
 
 template<typename T>
-void anneal_output(AnnealingRun<T> run, const std::string &results_filename) {
-    std::ofstream file_stream = std::ofstream(results_filename, std::ios::out | std::ios::app);
-    float start_temp = run.temperature;
-
-    file_mutex.lock();
-    file_stream << "Started processing block from temperature " << start_temp << ":" << std::endl;
-    file_stream << run << std::endl;
-    file_mutex.unlock();
-
-    anneal_output_silent(run);
-
-    file_mutex.lock();
-    file_stream << "Finished processing block; Start temperature was " << start_temp << "; Took " << run.step_counter
-                << " steps; Block data:" << std::endl << run << std::endl;
-    file_stream.close();
-    file_mutex.unlock();
+void anneal_output(AnnealingRun<T> &run, const RunInfo &info, const Session &session,
+                   const Server::LineWriter &write_line) {
+    if (session.results_filename != "NONE" and not info.resumed)
+        output_record(make_record(run, ResultsFile::STARTED, info.start_temp), session);
+    if (session.team_size > 1)
+        SweepTeam<T>(run, session.team_size, session.sweep_mode).anneal();
+    else
+        run.anneal();
+    if (run.stopped)
+        return;
+    ResultsFile::Record record = make_record(run, ResultsFile::FINISHED, info.start_temp);
+    output_summary(record, write_line);
+    output_record(record, session);
+    if (not session.checkpoint_dir.empty())
+        output_checkpoint(run, info, session, Checkpoint::FINISHED);
 }
 
-int main() {
-    std::mutex mutex;
-    mutex.unlock();
-    mutex.lock();
+template<typename T>
+void anneal_output_batch(ReplicaBatch<T> &batch, const std::vector<RunInfo> &infos, const Session &session,
+                         const Server::LineWriter &write_line) {
+    for (int replica_index = 0; replica_index < batch.size(); ++replica_index)
+        if (session.results_filename != "NONE" and not infos[replica_index].resumed)
+            output_record(make_record(batch[replica_index], ResultsFile::STARTED, infos[replica_index].start_temp),
+                          session);
+    batch.anneal();
+    for (int replica_index = 0; replica_index < batch.size(); ++replica_index) {
+        if (batch[replica_index].stopped)
+            continue;
+        ResultsFile::Record record = make_record(batch[replica_index], ResultsFile::FINISHED,
+                                                 infos[replica_index].start_temp);
+        output_summary(record, write_line);
+        output_record(record, session);
+        if (not session.checkpoint_dir.empty())
+            output_checkpoint(batch[replica_index], infos[replica_index], session, Checkpoint::FINISHED);
+    }
+}
+
+void print_line(const std::string &line) {
+    output_writer.write("", line + "\n");
+}
+
+template<typename T>
+void anneal_session(const Session &session, Lattice<T> &lattice, BlockTemplate<T> &block_template,
+                    ThreadPool &pool, const Server::LineWriter &write_line = print_line) {
+    BigFloat interaction_multiplier = BigFloat(1, session.mul_log);
+    int block_count = session.block_count;
+    // Runs annealed by a team of threads or exchanging temperatures are not batched
+    int replica_count = session.team_size > 1 or session.exchange_rounds > 0 ?
+                        1 : std::max(1, std::min(session.replica_count, block_count));
+    uint64_t run_key = session.runKey();
+    if (not session.checkpoint_dir.empty())
+        mkdir(session.checkpoint_dir.c_str(), 0755);
+    std::unique_ptr<Portfolio> portfolio;
+    if (session.portfolio_rungs > 0)
+        portfolio.reset(new Portfolio(Portfolio::evenRungs(std::max(session.temp_start, session.temp_final),
+                                                           session.portfolio_rungs), session.portfolio_keep));
+
+    auto create_run = [&](int run_index) {
+        AnnealingRun<T> run = AnnealingRun<T>(lattice);
+        run.block = block_template.instance(run_index);
+        run.temperature = session.temp_start +
+                          ((float) run_index / (float) block_count) * (session.temp_final - session.temp_start);
+        run.temperature_step = session.annealing_step;
+        run.temperature_threshold = session.temp_interaction_threshold;
+        run.interaction_multiplier = interaction_multiplier;
+        run.relaxation = session.relaxation;
+        run.formula = session.formula;
+        if (session.adaptive_schedule) {
+            run.temperature_step_min = session.step_min > 0 ? session.step_min : session.annealing_step / 8;
+            run.temperature_step_max = session.step_max > 0 ? session.step_max : session.annealing_step * 8;
+        }
+        return run;
+    };
+
+    // Level callbacks are set after the run state is restored
+    auto watch_run = [&](AnnealingRun<T> &run, const RunInfo &info) {
+        std::function<void(AnnealingRun<T> &)> checkpoint, prune, trace;
+        if (not session.checkpoint_dir.empty()) {
+            // State is copied on the worker, the file is written by the output thread
+            auto interval = std::chrono::duration<double>(session.checkpoint_interval);
+            auto last_checkpoint = std::chrono::steady_clock::now();
+            checkpoint = [&session, info, interval, last_checkpoint](AnnealingRun<T> &level_run) mutable {
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_checkpoint < interval)
+                    return;
+                last_checkpoint = now;
+                output_checkpoint(level_run, info, session, Checkpoint::RUNNING);
+            };
+        }
+        if (portfolio != nullptr) {
+            // Rungs above the current temperature are skipped
+            const std::vector<float> &rungs = portfolio->rungs();
+            unsigned int next_rung = 0;
+            while (next_rung < rungs.size() and rungs[next_rung] >= run.temperature)
+                next_rung++;
+            prune = [&portfolio, &rungs, next_rung](AnnealingRun<T> &level_run) mutable {
+                for (; next_rung < rungs.size() and level_run.temperature <= rungs[next_rung]; ++next_rung) {
+                    if (not portfolio->promote((int) next_rung, best_energy(level_run))) {
+                        level_run.stopped = true;
+                        return;
+                    }
+                }
+            };
+        }
+        if (not session.energy_trace.empty()) {
+            trace = [&session, info](AnnealingRun<T> &level_run) {
+                std::ostringstream out;
+                out << info.run_index << " " << level_run.temperature << " " << level_run.step_counter;
+                for (int set_index = 0; set_index < level_run.block.set_count; ++set_index)
+                    out << " " << level_run[set_index].energy(level_run.lattice);
+                output_writer.write(session.energy_trace, out.str() + "\n");
+            };
+        }
+        if (checkpoint or prune or trace) {
+            run.level_finished = [checkpoint, prune, trace](AnnealingRun<T> &level_run) mutable {
+                if (trace)
+                    trace(level_run);
+                if (checkpoint)
+                    checkpoint(level_run);
+                if (prune)
+                    prune(level_run);
+            };
+        }
+    };
+
+    // A shard takes every shard_count-th group of runs, so that every shard has runs of all temperatures
+    auto owned = [&](int run_number) {
+        return (run_number / replica_count) % session.shard_count == session.shard_index;
+    };
+
+    // The pool may be shared with other sessions, so finished jobs of this one are counted separately
+    std::mutex session_mutex;
+    std::condition_variable session_finished;
+    int unfinished_jobs = 0, session_runs = 0;
+    for (int run_number = 0; run_number < block_count; run_number += replica_count) {
+        if (not owned(run_number))
+            continue;
+        unfinished_jobs++;
+        session_runs += std::min(replica_count, block_count - run_number);
+    }
+
+    // All replicas of an exchange exist at once, so they are created up front and are not resumed
+    std::unique_ptr<ReplicaExchange<T>> exchange;
+    std::vector<RunInfo> exchange_infos;
+    if (session.exchange_rounds > 0) {
+        exchange.reset(new ReplicaExchange<T>(pool, session.exchange_rounds));
+        for (int run_index = 0; run_index < block_count; ++run_index) {
+            if (not owned(run_index))
+                continue;
+            AnnealingRun<T> run = create_run(run_index);
+            exchange_infos.push_back(RunInfo{run_index, run.temperature, false});
+            watch_run(run, exchange_infos.back());
+            exchange->add(std::move(run));
+        }
+        exchange->start([&](AnnealingRun<T> &run, int run_index) {
+            anneal_output(run, exchange_infos[run_index], session, write_line);
+            std::lock_guard<std::mutex> lock(session_mutex);
+            if (--unfinished_jobs == 0)
+                session_finished.notify_all();
+        });
+    }
+
+    // Runs are created lazily by the workers; the hottest runs take longest, so they are submitted first
+    for (int run_number = 0; exchange == nullptr and run_number < block_count; run_number += replica_count) {
+        if (not owned(run_number))
+            continue;
+        int first_run = run_number, last_run = std::min(run_number + replica_count, block_count);
+        if (session.temp_final > session.temp_start) {
+            first_run = block_count - last_run;
+            last_run = block_count - run_number;
+        }
+        pool.submit([&, first_run, last_run] {
+            std::vector<AnnealingRun<T>> runs;
+            std::vector<RunInfo> infos;
+            for (int run_index = first_run; run_index < last_run; ++run_index) {
+                AnnealingRun<T> run = create_run(run_index);
+                RunInfo info{run_index, run.temperature, false};
+                if (session.resume) {
+                    Checkpoint::Status status = Checkpoint::RUNNING;
+                    info.resumed = Checkpoint::restore(Checkpoint::filename(session.checkpoint_dir, run_key, run_index),
+                                                       run, run_key, run_index, status);
+                    if (info.resumed and status == Checkpoint::FINISHED) {
+                        // Results of finished runs are already saved, only the summary is repeated
+                        output_summary(make_record(run, ResultsFile::FINISHED, info.start_temp), write_line);
+                        continue;
+                    }
+                }
+                watch_run(run, info);
+                runs.push_back(std::move(run));
+                infos.push_back(info);
+            }
+            if (runs.size() > 1) {
+                // Replicas with neighbouring start temperatures go through a similar quantity of levels
+                ReplicaBatch<T> batch = ReplicaBatch<T>(lattice);
+                for (AnnealingRun<T> &run : runs)
+                    batch.add(std::move(run));
+                anneal_output_batch(batch, infos, session, write_line);
+            } else if (not runs.empty()) {
+                anneal_output(runs[0], infos[0], session, write_line);
+            }
+            std::lock_guard<std::mutex> lock(session_mutex);
+            if (--unfinished_jobs == 0)
+                session_finished.notify_all();
+        });
+    }
+
+    // Wait for all runs
+    std::unique_lock<std::mutex> lock(session_mutex);
+    session_finished.wait(lock, [&] { return unfinished_jobs == 0; });
+    if (portfolio != nullptr)
+        write_line("Portfolio: " + std::to_string(portfolio->stopped()) + " of " + std::to_string(session_runs) +
+                   " runs stopped");
+    if (exchange != nullptr)
+        write_line("Replica exchange: " + std::to_string(exchange->accepted()) + " of " +
+                   std::to_string(exchange->attempted()) + " swaps accepted");
+
+    // The writer outlives the session in config and server modes, so its files are not kept open
+    if (session.results_filename != "NONE")
+        output_writer.close(session.results_filename);
+    if (not session.energy_trace.empty())
+        output_writer.close(session.energy_trace);
+}
+
+/*
+ * Run a session in worker processes that share a single copy of a dense lattice
+ */
+template<typename T>
+int shard_session(const Options &options, const Session &session, SessionCache<T> &cache) {
+    std::string lattice_shared;
+    Shards::SharedObjectGuard shared_guard;
+    {
+        // The coordinator does not keep its copy, not even in the cache, workers map the shared one
+        std::shared_ptr<Lattice<T>> lattice = cache.takeLattice(session.lattice_initializer, session.lattice_storage);
+        if (not lattice->sparse()) {
+            lattice_shared = Shards::sharedName();
+            shared_guard.reset(lattice_shared);
+            lattice->share(lattice_shared);
+        }
+    }
+    Options worker_options = options;
+    worker_options.update(session.toOptions());
+    return Shards::run(output_writer, worker_options, session.shard_processes, lattice_shared, print_line);
+}
+
+/*
+ * OPTIONS (given as key=value command line arguments):
+ * replicas - quantity of runs with neighbouring start temperatures annealed together by one worker,
+ *            which streams the lattice once per sweep for all of them (default 1). Pays off on lattices
+ *            that do not fit in cache
+ * config   - MARS_CI.py session config file. All sessions are run in this process one after another,
+ *            lattices and blocks are loaded once and the worker threads are shared. Other options
+ *            override session parameters, the thread quantity is the largest one among the sessions
+ * server   - Unix domain socket path. The program becomes a resident server that runs jobs sent to the socket
+ *            (see Server.h) on a shared pool of worker threads; each job is a single session config
+ * threads  - worker thread quantity of the server (default: hardware thread quantity)
+ * cache    - quantity of lattices and blocks kept loaded by the server (default 8)
+ * results_format - format of the results file: text or binary (default text). Binary results are converted
+ *            to text with MARS_CI_convert
+ * checkpoint - directory to save run states in. A run saves its state after a temperature level at most
+ *            once in checkpoint_interval seconds (default 60) and when it is finished
+ * resume   - set to 1 to continue a session from its checkpoints: finished runs only print their summary,
+ *            unfinished ones continue from their last saved temperature level. Checkpoints of sessions with
+ *            other parameters are ignored
+ * team     - quantity of threads that anneal a single run together (default 1), in addition to the worker
+ *            threads. Useful when there are fewer runs than cores; replicas is ignored if team is set
+ * team_mode - sweep order of a team: hybrid (Gauss-Seidel inside a thread's spin partition) or jacobi
+ *            (default hybrid). See SweepTeam.h for convergence behavior
+ * schedule - temperature schedule: fixed or adaptive (default fixed). The adaptive schedule starts with
+ *            the annealing step, doubles it after levels that converge in a few sweeps and halves it
+ *            after slow ones, keeping it between step_min and step_max (default step / 8 and step * 8)
+ * relaxation - over-relaxation factor of spin updates, 1 to 2 (default 1, the plain iteration).
+ *            Sweep counts are reported as the step count of every run in the results file
+ * portfolio - quantity of rungs for successive halving (default 0, disabled). Rungs are spread evenly
+ *            between the highest start temperature and zero; at every rung a run is stopped unless the
+ *            lowest Hamiltonian among its sets is within the best portfolio_keep fraction (default 0.5)
+ *            of the runs that have reached the rung. Stopped runs print no summary and save no results
+ * energy_trace - file to append the energies of every run after each temperature level to, one line per level:
+ *            run index, temperature, step count and the Hamiltonian of every set. Energies are tracked
+ *            together with the local fields, so no lattice pass is made for them (except in replica batches
+ *            and teams, which keep local fields of their own)
+ * lattice_storage - storage of dense lattice elements: native (as loaded), fp16, bf16 or int8 (with a scale
+ *            per row). Reduced precision halves or quarters lattice memory and the bandwidth of every sweep;
+ *            elements are converted to float as rows are read. Binary lattice files written in these types
+ *            by MARS_CI_convert are mapped directly, without a full precision copy. Their header and length
+ *            are checked on load but the checksum is not, check it with MARS_CI_convert verify
+ * formula  - interaction formula of linked sets: sym or asym (default sym). See Formula.h
+ * exchange - quantity of replica exchange rounds (default 0, disabled). The runs form a temperature ladder:
+ *            in every round each run converges at its temperature, then runs on neighbouring temperatures
+ *            swap them with the Metropolis criterion on their energies. After the last round every run
+ *            anneals down from the temperature it has reached. Runs are not batched and not resumed in this
+ *            mode. See ReplicaExchange.h
+ * metrics  - file to export runtime counters to every metrics_interval seconds (default 10) and at exit:
+ *            temperature levels, sweeps (also by level and by temperature), spin updates and their rate,
+ *            probability recalculations, annealing, worker job, idle and output time. metrics_format is
+ *            json or prometheus (text exposition format, for the node exporter textfile collector)
+ *            (default json). Counters are kept per thread and updated once per level, so they are
+ *            always collected; this option only enables the export. See Metrics.h
+ * shards   - quantity of worker processes a session is split into (default 0, disabled). Every worker anneals
+ *            every shards-th group of runs (of replicas, or a single run) with its own threads worker threads.
+ *            A dense lattice is loaded once and placed in POSIX shared memory, which the workers map read-only,
+ *            so the node holds one lattice copy; the object is removed when the workers exit. Sparse lattices
+ *            are loaded by every worker. Workers write results, energy_trace and metrics to files with a
+ *            .shard<index> suffix; results and energy traces are appended to the session files afterwards.
+ *            Portfolios and exchange ladders are formed within a worker. Not available in server mode
+ * shard    - index/count of the shard this process runs; set by the coordinator for its workers, together
+ *            with lattice_shm, the name of the shared lattice object. See Shards.h
+ */
+
+int main(int argc, char **argv) {
+    Options options(argc, argv);
     typedef float value_type;
     Random::init(0);
-    std::cout << "MARS analysis by A. Yavorski, CPU edition, version " << VERSION << ", build " << BUILD << std::endl;
+    // Worker output is forwarded by the coordinator, which has printed the banner
+    if (not options.has("shard"))
+        std::cout << "MARS analysis by A. Yavorski, CPU edition, version " << VERSION << ", build " << BUILD
+                  << std::endl;
+    std::unique_ptr<MetricsExporter> metrics_exporter;
+    if (options.has("metrics"))
+        metrics_exporter.reset(new MetricsExporter(output_writer, options.get("metrics"),
+                                                   options.get("metrics_format", "json"),
+                                                   options.getDouble("metrics_interval", 10)));
+    if (options.has("shard")) {
+        // Worker process of a sharded session
+        SessionCache<value_type> cache;
+        try {
+            Session session(options);
+            std::shared_ptr<Lattice<value_type>> lattice = session.lattice_shared.empty() ?
+                    cache.lattice(session.lattice_initializer, session.lattice_storage) :
+                    cache.lattice(LatticeFile::SHARED_PREFIX + session.lattice_shared);
+            std::shared_ptr<BlockTemplate<value_type>> block_template =
+                    cache.blockTemplate(lattice->size(), session.block_filename, session.links_filename);
+            ThreadPool pool(session.threads);
+            anneal_session(session, *lattice, *block_template, pool);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (options.has("server")) {
+        SessionCache<value_type> cache(options.getInt("cache", 8));
+        ThreadPool pool(options.getInt("threads", (int) std::max(1u, std::thread::hardware_concurrency())));
+        Server server(options.get("server"), [&](const Options &request, const Server::LineWriter &write_line) {
+            Options config;
+            config.set("threads", "1");
+            config.update(request);
+            Session session(config);
+            std::shared_ptr<Lattice<value_type>> lattice = cache.lattice(session.lattice_initializer, session.lattice_storage);
+            std::shared_ptr<BlockTemplate<value_type>> block_template =
+                    cache.blockTemplate(lattice->size(), session.block_filename, session.links_filename);
+            anneal_session(session, *lattice, *block_template, pool, write_line);
+        });
+        std::cout << "Listening on " << options.get("server") << std::endl;
+        server.run();
+        return 1;
+    }
+
+    SessionCache<value_type> cache;
+    if (options.has("config")) {
+        std::vector<Session> sessions;
+        std::vector<Options> session_configs;
+        int threads = 1;
+        for (const Options &config : Session::loadConfig(options.get("config"), options)) {
+            try {
+                sessions.emplace_back(config);
+                session_configs.push_back(config);
+                if (sessions.back().shard_processes <= 1)
+                    threads = std::max(threads, sessions.back().threads);
+            } catch (std::invalid_argument &e) {
+                std::cerr << "Error: " << e.what() << "; session aborted" << std::endl;
+            }
+        }
+
+        ThreadPool pool(threads);
+        for (unsigned int session_index = 0; session_index < sessions.size(); ++session_index) {
+            const Session &session = sessions[session_index];
+            print_line("Session " + std::to_string(session_index + 1) + " of " + std::to_string(sessions.size()));
+            // A lattice or block that cannot be loaded aborts its session only
+            std::shared_ptr<Lattice<value_type>> lattice;
+            std::shared_ptr<BlockTemplate<value_type>> block_template;
+            try {
+                if (session.shard_processes > 1) {
+                    shard_session<value_type>(session_configs[session_index], session, cache);
+                    continue;
+                }
+                lattice = cache.lattice(session.lattice_initializer, session.lattice_storage);
+                block_template = cache.blockTemplate(lattice->size(), session.block_filename, session.links_filename);
+            } catch (std::exception &e) {
+                std::cerr << "Error: " << e.what() << "; session aborted" << std::endl;
+                continue;
+            }
+            anneal_session(session, *lattice, *block_template, pool);
+        }
+        return 0;
+    }
+
+    Session session;
+    try {
+        session.setOptional(options);
+    } catch (std::invalid_argument &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
 
     // Load temperature bounds
-    float temp_start = 6, temp_final = 8.5, annealing_step = 0.1;
 #ifndef NO_INPUT
     std::cout << "Start temp?" << std::endl;
-    std::cin >> temp_start;
+    std::cin >> session.temp_start;
     std::cout << "Final temp?" << std::endl;
-    std::cin >> temp_final;
+    std::cin >> session.temp_final;
     std::cout << "Annealing step?" << std::endl;
-    std::cin >> annealing_step;
+    std::cin >> session.annealing_step;
 #endif
 
     // Load lattice
-    Lattice<value_type> lattice;
-    std::string lattice_initializer = "1000";
 #ifndef NO_INPUT
     std::cout << "Lattice file path (or size if random lattice needed)?" << std::endl;
-    std::cin >> lattice_initializer;
+    std::cin >> session.lattice_initializer;
 #endif
-
+    // A sharded session loads the lattice once all parameters are known
+    std::shared_ptr<Lattice<value_type>> lattice;
     try {
-        // User entered size
-        lattice = Lattice<value_type>(std::stoi(lattice_initializer), true);
-    }
-    catch (std::exception &e) {
-        // User entered path
-        lattice = Lattice<value_type>(lattice_initializer);
+        if (session.shard_processes <= 1)
+            lattice = cache.lattice(session.lattice_initializer, session.lattice_storage);
+    } catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
     }
-    Lattice<value_type> &lattice_reference = lattice;
 
     // Load thread quantity
-    int threads = 1;
 #ifndef NO_INPUT
     std::cout << "Thread quantity?" << std::endl;
-    std::cin >> threads;
+    std::cin >> session.threads;
 #endif
 
     // Load block
-    std::string block_filename = "4";
-    int block_count = 50;
 #ifndef NO_INPUT
     std::cout << "Block file location (Enter block size to create a random block)?" << std::endl;
-    std::cin >> block_filename;
+    std::cin >> session.block_filename;
     std::cout << "Block quantity?" << std::endl;
-    std::cin >> block_count;
+    std::cin >> session.block_count;
 #endif
 
     // Load link configuration
-    std::string links_filename = "/home/alexander/CLionProjects/MARS_2/link";
 #ifndef NO_INPUT
     std::cout << "Links file location (NONE for no interaction)?" << std::endl;
-    std::cin >> links_filename;
+    std::cin >> session.links_filename;
 #endif
-    int sz = lattice.size();
-
-    BlockTemplate<value_type> block_template;
+    std::shared_ptr<BlockTemplate<value_type>> block_template;
     try {
-        int block_size = stoi(block_filename);
-        block_template = BlockTemplate<value_type>(sz, block_size, links_filename);
+        if (lattice != nullptr)
+            block_template = cache.blockTemplate(lattice->size(), session.block_filename, session.links_filename);
     } catch (std::exception &e) {
-        block_template = BlockTemplate<value_type>(sz, block_filename, links_filename);
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
     }
 
     // Interaction multiplier
-    double mul_log = -2;
 #ifndef NO_INPUT
     std::cout << "Interaction multiplier (decimal log)?" << std::endl;
-    std::cin >> mul_log;
+    std::cin >> session.mul_log;
 #endif
 
-    BigFloat interaction_multiplier = BigFloat(1, mul_log);
-
-    float temp_interaction_threshold = 3;
 #ifndef NO_INPUT
     std::cout << "Temperature threshold?" << std::endl;
-    std::cin >> temp_interaction_threshold;
+    std::cin >> session.temp_interaction_threshold;
 #endif
 
     // Enable/disable full log
-    std::string results_filename = "/home/alexander/CLionProjects/MARS_2/results.txt";
 #ifndef NO_INPUT
     std::cout << "File to save all results (NONE for no saving)?" << std::endl;
-    std::cin >> results_filename;
+    std::cin >> session.results_filename;
 #endif
 
     // Start annealing
-    auto *threads_arr = new std::thread[block_count];
-
-    //Init semaphore
-    sem_init(&semaphore, 1, threads);
-
-    // Launch threads
-    for (int run_index = 0; run_index < block_count; ++run_index) {
-        AnnealingRun<value_type> run = AnnealingRun<value_type>(lattice_reference);
-        run.block = block_template.instance();
-        run.temperature =
-                temp_start + ((float) run_index / (float) block_count) * (temp_final - temp_start);
-        run.temperature_step = annealing_step;
-        run.temperature_threshold = temp_interaction_threshold;
-        run.interaction_multiplier = interaction_multiplier;
-
-        if (results_filename == "NONE")
-            threads_arr[run_index] = std::thread(anneal_output_silent<value_type>, run);
-        else
-            threads_arr[run_index] = std::thread(anneal_output<value_type>, run, results_filename);
+    if (session.shard_processes > 1) {
+        try {
+            return shard_session<value_type>(options, session, cache) == 0 ? 0 : 1;
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
     }
-
-    // Join all threads
-    for (int run_index = 0; run_index < block_count; ++run_index)
-        threads_arr[run_index].join();
+    ThreadPool pool(session.threads);
+    anneal_session(session, *lattice, *block_template, pool);
 }